@@ -0,0 +1,236 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 18:47:15 2026
+
+Fused calibration kernels for sequences of infrared camera frames (see Frame.calib_seq).
+
+Dark subtraction, estimation of the background from the background ROIs, background subtraction and error
+propagation are done per chunk of frames, in float32, directly into the output buffers. The chunks are spread
+over a pool of threads (numpy releases the GIL while computing), so no full-size float64 temporaries are made.
+
+"""
+
+import os
+import numpy as np
+from concurrent.futures import ThreadPoolExecutor
+from nottcontrol.camera.welford import WelfordAccumulator
+
+_pool = None
+
+
+def _threads():
+    global _pool
+    if _pool is None:
+        _pool = ThreadPoolExecutor(max_workers=os.cpu_count() or 1)
+    return _pool
+
+
+def _run_chunks(func, n, chunk):
+    # Runs func(k1,k2) over chunks [k1,k2) of the n frames, in parallel
+    futures = [_threads().submit(func, k, min(k+chunk, n)) for k in range(0, n, chunk)]
+    for future in futures:
+        future.result()
+
+
+def _seq_std(data, axis):
+    # Per-pixel std over the sequence, in one pass
+    acc = WelfordAccumulator()
+    acc.add_batch(data, axis=axis)
+    return acc.std()
+
+
+def fill_bad(values, bad):
+    """
+    Replace bad pixels, in place, by the mean of the good pixels in the same row (last axis).
+
+    Parameters
+    ----------
+    values : (...,h,w) numpy array
+    bad : (h,w) or (roi,h,w) boolean numpy array, broadcastable against the leading axes of values
+        (e.g. a (roi,h,w) mask for (roi,N,h,w) values is given as bad[:,np.newaxis]).
+    """
+    good = ~bad
+    ngood = np.maximum(good.sum(axis=-1, keepdims=True), 1)
+    row_mean = np.where(good, values, 0).sum(axis=-1, keepdims=True) / ngood
+    np.copyto(values, np.broadcast_to(row_mean, values.shape), where=np.broadcast_to(bad, values.shape), casting="unsafe")
+    return values
+
+
+def row_weights(bad, shape):
+    # Weights of the pixels in a row sum, such that bad pixels count as the mean of the good pixels of their row
+    if bad is None:
+        return np.ones(shape)
+    good = (~bad).astype(np.float64)
+    return good * shape[-1] / np.maximum(good.sum(axis=-1, keepdims=True), 1)
+
+
+def calib_rois_seq(rois_data, dark_mean, dark_mean_std, bg_roi_idx, out=None, out_std=None, chunk=32, bad=None):
+    """
+    Calibrate a sequence of ROI frames: dark subtraction, then subtraction of the mean dark-subtracted background ROI.
+
+    Parameters
+    ----------
+    rois_data : (roi,N,h,w) numpy array
+        Raw ROI frames.
+    dark_mean, dark_mean_std : (roi,h,w) numpy arrays
+        Master dark and its std.
+    bg_roi_idx : list of int
+        Indices of the background ROIs.
+    out : (roi,N,h,w) float32 numpy array, optional
+        Buffer for the calibrated frames.
+    out_std : (roi,h,w) float32 numpy array, optional
+        Buffer for the std map (science sample std + dark mean std + mean background error).
+    bad : (roi,h,w) boolean numpy array, optional
+        Bad pixels (see camera/robust.py), replaced by the mean of the good pixels of their ROI row.
+
+    Returns
+    -------
+    (out, out_std)
+    """
+    nroi, n = rois_data.shape[:2]
+    if out is None:
+        out = np.empty(rois_data.shape, dtype=np.float32)
+    if out_std is None:
+        out_std = np.empty((nroi,)+rois_data.shape[2:], dtype=np.float32)
+    dark = dark_mean.astype(np.float32)
+    nbg = len(bg_roi_idx)
+
+    def kernel(k1, k2):
+        block = out[:, k1:k2]
+        # Dark subtract
+        np.subtract(rois_data[:, k1:k2], dark[:, np.newaxis], out=block, casting="unsafe")
+        if bad is not None:
+            fill_bad(block, bad[:, np.newaxis])
+        # Mean dark-subtracted background of each frame
+        bg = block[bg_roi_idx[0]].copy()
+        for i in bg_roi_idx[1:]:
+            bg += block[i]
+        bg /= nbg
+        # Background subtract
+        block -= bg[np.newaxis]
+
+    _run_chunks(kernel, n, chunk)
+
+    # Error propagation: total std = hypot(science sample std, dark mean std), plus the mean background error
+    std = np.hypot(_seq_std(rois_data, axis=1), dark_mean_std)
+    if bad is not None:
+        fill_bad(std, bad)
+    bg_err = np.sqrt(np.square(std[bg_roi_idx]).sum(axis=0)) / nbg
+    np.hypot(std, bg_err[np.newaxis], out=out_std, casting="unsafe")
+    return out, out_std
+
+
+def calib_full_seq(data, dark_mean, dark_mean_std, out=None, out_std=None, chunk=32, bad=None):
+    """
+    Calibrate a sequence of full frames (dark subtraction only). Same conventions as calib_rois_seq, for (N,h,w) frames.
+    Bad pixels (bad : (h,w) mask) are replaced by the mean of the good pixels of their frame row.
+    """
+    n = data.shape[0]
+    if out is None:
+        out = np.empty(data.shape, dtype=np.float32)
+    if out_std is None:
+        out_std = np.empty(data.shape[1:], dtype=np.float32)
+    dark = dark_mean.astype(np.float32)
+
+    def kernel(k1, k2):
+        np.subtract(data[k1:k2], dark[np.newaxis], out=out[k1:k2], casting="unsafe")
+        if bad is not None:
+            fill_bad(out[k1:k2], bad)
+
+    _run_chunks(kernel, n, chunk)
+    np.hypot(_seq_std(data, axis=0), dark_mean_std, out=out_std, casting="unsafe")
+    if bad is not None:
+        fill_bad(out_std, bad)
+    return out, out_std
+
+
+def calib_rows(rois_data, dark_mean, dark_mean_std, bg_roi_idx, row_mask=None, master=False, chunk=32, row_sums=None, bad=None,
+               master_rois=None):
+    """
+    Calibrated spectra (ROI rows summed over the ROI width), straight from the raw ROI frames: same result as
+    summing Frame.calib_seq / Frame.calib_master over the last axis, but without building the calibrated 4-D cube.
+    Since the calibration is linear, the raw rows are summed first; only the error propagation needs per-pixel
+    statistics, which are accumulated in the same pass.
+
+    Parameters
+    ----------
+    rois_data : (roi,N,h,w) numpy array
+        Raw ROI frames.
+    dark_mean, dark_mean_std : (roi,h,w) numpy arrays
+        Master dark and its std.
+    bg_roi_idx : list of int
+        Indices of the background ROIs.
+    row_mask : (h,) boolean numpy array, optional
+        Rows to calibrate (e.g. HumInt.sc_mask, the science wavelengths). Other rows are not computed and set to NaN.
+    master : bool
+        If True, calibrate the master frame (mean over the sequence) instead of the individual frames.
+    row_sums : (roi,N,h') numpy array, optional
+        Raw row sums of the rows in row_mask, e.g. the "rows" layout of camera/roi_gather.py. Computed here if not given.
+        Not used if there are bad pixels.
+    bad : (roi,h,w) boolean numpy array, optional
+        Bad pixels, counted as the mean of the good pixels of their ROI row.
+    master_rois : ((roi,h,w), (roi,h,w)) numpy arrays, optional
+        Master frame of the ROIs and its std (Frame.master_rois, i.e. by the configured combiner). If given with master,
+        the master frame is calibrated from it instead of from the mean over the sequence.
+
+    Returns
+    -------
+    If master : (cal_mean, cal_mean_std), both (h,roi)
+    Else      : (cal_seq, cal_seq_std), both (N,h,roi); the std does not depend on the frame.
+    """
+    nroi, n, h = rois_data.shape[:3]
+    rows = np.arange(h) if row_mask is None else np.flatnonzero(row_mask)
+    nbg = len(bg_roi_idx)
+
+    # Row sum weights, bad pixels are replaced by the mean of the good pixels of their row
+    weights = None if bad is None else row_weights(bad[:, rows], bad[:, rows].shape)
+    if master and master_rois is not None:
+        # Given master frame: dark subtract and sum its rows, no pass over the frames
+        sci_mean, sci_std = master_rois[0][:, rows], master_rois[1][:, rows]
+        if weights is None:
+            weights = 1.
+        cal = ((sci_mean - dark_mean[:, rows]) * weights).sum(axis=-1)
+    else:
+        # Raw row sums and per-pixel statistics of the selected rows, in one pass over chunks of frames
+        sum_rows = row_sums is None or weights is not None
+        if sum_rows:
+            row_sums = np.empty((nroi, n, len(rows)), dtype=np.float64)
+        acc = WelfordAccumulator()
+        for k in range(0, n, chunk):
+            block = rois_data[:, k:k+chunk][:, :, rows]
+            if weights is not None:
+                row_sums[:, k:k+chunk] = np.einsum('rnhw,rhw->rnh', block, weights)
+            elif sum_rows:
+                block.sum(axis=-1, dtype=np.float64, out=row_sums[:, k:k+chunk])
+            acc.add_batch(block, axis=1, chunk=chunk)
+        if weights is None:
+            weights = 1.
+        # Dark subtract
+        cal = row_sums - (dark_mean[:, rows] * weights).sum(axis=-1)[:, np.newaxis]
+        sci_std = acc.std()
+        if master:
+            cal = cal.mean(axis=1)
+            sci_std /= np.sqrt(max(n, 1))
+
+    # Background subtract
+    cal -= cal[bg_roi_idx].mean(axis=0)[np.newaxis]
+    # Error propagation per pixel (science sample std + dark mean std + mean background error), then summed over the row
+    std = np.hypot(sci_std, dark_mean_std[:, rows])
+    if bad is not None:
+        # Bad pixels do not enter the mean background error
+        fill_bad(std, bad[:, rows])
+    bg_err = np.sqrt(np.square(std[bg_roi_idx]).sum(axis=0)) / nbg
+    std = (np.hypot(std, bg_err[np.newaxis]) * weights).sum(axis=-1)
+
+    # (h,roi) spectra, or (N,h,roi) for a sequence
+    if master:
+        out = np.full((h, nroi), np.nan)
+        out_std = np.full((h, nroi), np.nan)
+        out[rows] = cal.T
+        out_std[rows] = std.T
+    else:
+        out = np.full((n, h, nroi), np.nan)
+        out_std = np.full((n, h, nroi), np.nan)
+        out[:, rows] = cal.transpose((1, 2, 0))
+        out_std[:, rows] = std.T[np.newaxis]
+    return out, out_std
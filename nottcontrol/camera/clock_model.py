@@ -0,0 +1,174 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 11:20:05 2026
+
+This class reconciles the internal clock of the Infratec camera with the clock of the acquisition machine.
+
+The camera stamps every frame with its own (drifting) millisecond clock. The machine receives the frame a
+variable, but strictly positive, delay later. The earliest arrivals therefore trace the lower envelope
+    host_time = offset + (1 + drift) * camera_time
+which is fitted online: the minimum of (host_time - camera_time) is taken over short blocks of frames and a
+straight line is fitted through these block minima by exponentially weighted least squares.
+Frames are stamped from the very first one onwards; the estimate only sharpens as more frames come in.
+Stamps are strictly increasing: a refit never stamps a frame before the previous one.
+
+Optionally, the machine clock itself is referenced to the PLC NTP time (INFRATEC_TRIGERS.sNTPExtTime).
+
+"""
+
+from datetime import datetime, timedelta
+
+
+class ClockModel(object):
+
+    def __init__(self, block=200, forget=0.98, delay_gain=0.01):
+        """
+        Parameters
+        ----------
+        block : int
+            Amount of frames over which the minimal offset is taken, per fitted point (200 frames ~ 1 s at 200 Hz).
+        forget : float
+            Exponential forgetting factor (0,1] of the fitted points. Allows the model to follow a varying drift.
+        delay_gain : float
+            Gain of the exponential moving average of the delay estimate.
+        """
+        self.block = block
+        self.forget = forget
+        self.delay_gain = delay_gain
+        self.reset()
+
+    def reset(self):
+        # Origin of the camera and host time axes (ms), set by the first frame
+        self._cam0 = None
+        self._host0 = None
+        # Current block minimum
+        self._block_n = 0
+        self._block_min = None
+        self._block_cam = None
+        # Weighted least squares sums of the block minima (x = camera ms, y = offset ms)
+        self._sw = self._sx = self._sy = self._sxx = self._sxy = 0.
+        self._npoints = 0
+        # Model parameters, relative to the origin
+        self.offset_ms = 0.
+        self.drift = 0.
+        # Delay between frame stamp and reception on the host (ms)
+        self.delay_ms = None
+        self.delay_max_ms = None
+        # Delay between frame stamp and its registration in the database (ms)
+        self.write_delay_ms = None
+        self.write_delay_max_ms = None
+        # Offset between the PLC NTP time and the host time (ms)
+        self.reference_offset_ms = 0.
+        self.frames = 0
+        # Last returned stamp (unix ms)
+        self._last_stamp_ms = None
+
+    @staticmethod
+    def _to_ms(utc_time):
+        return (utc_time - datetime(1970, 1, 1)).total_seconds() * 1000.
+
+    def update(self, camera_ms, host_time):
+        """
+        Feed one frame to the model and return its stamp.
+
+        Parameters
+        ----------
+        camera_ms : float
+            IRBGrab timestamp of the frame (ms).
+        host_time : datetime
+            Time (UTC, no timezone info) at which the frame was received on the host.
+
+        Returns
+        -------
+        stamp : datetime
+            Estimated time (UTC, no timezone info) at which the frame was taken.
+        """
+        host_ms = self._to_ms(host_time)
+        if self._cam0 is None:
+            self._cam0 = camera_ms
+            self._host0 = host_ms
+        x = camera_ms - self._cam0
+        y = (host_ms - self._host0) - x
+        self.frames += 1
+
+        # Lower envelope over the current block
+        if self._block_min is None or y < self._block_min:
+            self._block_min = y
+            self._block_cam = x
+        self._block_n += 1
+        if self._npoints == 0:
+            # No fitted point yet: use the running minimum, so that the very first frames are stamped as well
+            self.offset_ms = self._block_min
+        if self._block_n >= self.block:
+            self._add_point(self._block_cam, self._block_min)
+            self._block_n = 0
+            self._block_min = None
+
+        stamp_ms = self.predict_ms(camera_ms)
+        # Every refit moves offset and drift (most of all during the first block, where the offset is a running minimum),
+        # which must not reorder frames: stamps are kept strictly increasing, by at least 1 ms once rounded to ms
+        # (segment store lookups and the BLOCK duplicate policy of the database rely on that)
+        if self._last_stamp_ms is not None:
+            stamp_ms = max(stamp_ms, round(self._last_stamp_ms) + 1.)
+        self._last_stamp_ms = stamp_ms
+        delay = host_ms + self.reference_offset_ms - stamp_ms
+        self.delay_ms, self.delay_max_ms = self._smooth(delay, self.delay_ms, self.delay_max_ms)
+        return self.to_datetime(stamp_ms)
+
+    def add_write_delay(self, stamp, host_time):
+        # Register that the frame stamped "stamp" was written to the database at host time "host_time"
+        delay = self._to_ms(host_time) + self.reference_offset_ms - self._to_ms(stamp)
+        self.write_delay_ms, self.write_delay_max_ms = self._smooth(delay, self.write_delay_ms, self.write_delay_max_ms)
+
+    def _smooth(self, delay, average, maximum):
+        # Exponential moving average and slowly decaying maximum of a delay (O(1) per sample)
+        if average is None:
+            return delay, delay
+        average += self.delay_gain * (delay - average)
+        maximum = max(delay, maximum + self.delay_gain * (delay - maximum))
+        return average, maximum
+
+    def _add_point(self, x, y):
+        f = self.forget
+        self._sw = f*self._sw + 1.
+        self._sx = f*self._sx + x
+        self._sy = f*self._sy + y
+        self._sxx = f*self._sxx + x*x
+        self._sxy = f*self._sxy + x*y
+        self._npoints += 1
+        det = self._sw*self._sxx - self._sx*self._sx
+        if self._npoints >= 2 and det > 0:
+            self.drift = (self._sw*self._sxy - self._sx*self._sy) / det
+            self.offset_ms = (self._sy - self.drift*self._sx) / self._sw
+        else:
+            self.offset_ms = y
+
+    def add_reference(self, host_time, reference_time):
+        """
+        Reference the host clock to an external clock (PLC NTP time), read at host time "host_time".
+        Stamps are shifted by the (smoothed) difference between both clocks.
+        """
+        diff = self._to_ms(reference_time) - self._to_ms(host_time)
+        if self.reference_offset_ms == 0.:
+            self.reference_offset_ms = diff
+        else:
+            self.reference_offset_ms += 0.1 * (diff - self.reference_offset_ms)
+
+    def predict_ms(self, camera_ms):
+        # Host time (unix ms) at which a frame with the given camera timestamp was taken, without updating the model
+        x = camera_ms - self._cam0
+        return self._host0 + x + self.offset_ms + self.drift*x + self.reference_offset_ms
+
+    def to_datetime(self, unix_ms):
+        return datetime(1970, 1, 1) + timedelta(milliseconds=unix_ms)
+
+    def state(self):
+        # Current model parameters, e.g. for publishing to the database
+        return {"offset_ms": self.offset_ms,
+                "drift": self.drift,
+                "delay_ms": self.delay_ms,
+                "delay_max_ms": self.delay_max_ms,
+                "write_delay_ms": self.write_delay_ms,
+                "write_delay_max_ms": self.write_delay_max_ms,
+                "reference_offset_ms": self.reference_offset_ms,
+                "frames": self.frames}
@@ -0,0 +1,54 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 15:02:18 2026
+
+This class co-adds infrared camera frames with a running, in-place accumulator.
+
+Each incoming frame is added to a uint32 sum as it arrives, so memory use does not depend on the amount of co-added frames and no burst allocation happens
+once the requested amount is reached.
+
+"""
+
+import numpy as np
+
+
+class CoaddAccumulator(object):
+
+    def __init__(self, nframes=1):
+        """
+        Parameters
+        ----------
+        nframes : int
+            Amount of frames to co-add (1-999 in the camera GUI; a uint32 sum holds up to 65536 uint16 frames).
+        """
+        self.nframes = nframes
+        self._sum = None
+        self.count = 0
+
+    def clear(self):
+        self.count = 0
+
+    def add(self, img):
+        """
+        Add one frame.
+
+        Returns
+        -------
+        coadded : numpy array or None
+            The co-added (averaged) frame, in the dtype of the input frames, once "nframes" frames have been added. None otherwise.
+        """
+        if self._sum is None or self._sum.shape != img.shape:
+            self._sum = np.zeros(img.shape, dtype=np.uint32)
+            self.count = 0
+        if self.count == 0:
+            self._sum[...] = img
+        else:
+            np.add(self._sum, img, out=self._sum, casting="unsafe")
+        self.count += 1
+
+        if self.count < self.nframes:
+            return None
+        # Truncating average, as the frame dtype is maintained (otherwise the background subtraction throws an error)
+        coadded = (self._sum // self.count).astype(img.dtype)
+        self.count = 0
+        return coadded
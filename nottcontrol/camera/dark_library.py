@@ -0,0 +1,201 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 19:36:08 2026
+
+This class keeps a library of master dark frames on disk, so that calibration routines can reuse a matching dark
+instead of closing the shutters and integrating a fresh one.
+
+A dark is valid for one camera configuration, which defines its key:
+    integration time (IntegTime, camera parameter 262), window (parameters 292-295), ROI table and cryostat
+    temperature (rounded to buckets of "temp_bucket" degrees).
+Per key, the latest dark is stored as
+    <directory>/<key>.master.npy : full-frame master dark (float64)
+    <directory>/<key>.std.npy    : std on the master dark
+    <directory>/<key>.json       : metadata (amount of frames, first/last frame ID, integration time, temperature, creation
+                                   time) and the per-frame ROI values of the dark frames (see roi_statistics)
+A lookup is a direct file access by key; the frames are memory-mapped, not read.
+
+"""
+
+import hashlib
+import json
+import time
+import numpy as np
+from pathlib import Path
+from nottcontrol.camera.frame import MasterFrame, Frame
+from nottcontrol.camera.frame_store import id_to_unix_ms
+from nottcontrol.script.lib.nott_database import get_reduced
+
+# Per-frame ROI values written to the database by the camera GUI, as roi<n>_<kind>
+roi_kinds = ("max", "avg", "sum")
+
+
+class DarkLibrary(object):
+
+    def __init__(self, directory, max_age=3600., min_frames=10, temp_bucket=0.5):
+        """
+        Parameters
+        ----------
+        directory : string
+            Directory holding the library.
+        max_age : float
+            Darks older than this (s) are not reused.
+        min_frames : int
+            Darks of fewer frames are not reused.
+        temp_bucket : float
+            Width of the temperature buckets (degrees). Darks taken in another bucket are not reused.
+        """
+        self.directory = Path(directory)
+        self.max_age = max_age
+        self.min_frames = min_frames
+        self.temp_bucket = temp_bucket
+
+    def key(self, integtime, window=None, rois=None, temperature=None):
+        """
+        Library key of a camera configuration.
+
+        Parameters
+        ----------
+        integtime : float
+            Integration time (us).
+        window : dict, optional
+            Camera window (keys "w","h","x","y"). The default is the configured window.
+        rois : list of Roi objects, optional
+            ROI table. The default is the configured ROIs.
+        temperature : float, optional
+            Cryostat temperature. If None, darks are not matched by temperature.
+        """
+        if window is None:
+            window = Frame.window_cfg
+        if rois is None:
+            rois = Frame.rois_cfg
+        roi_table = ";".join(f"{float(roi.x):.2f},{float(roi.y):.2f},{float(roi.w):.2f},{float(roi.h):.2f}" for roi in rois)
+        roi_hash = hashlib.sha1(roi_table.encode()).hexdigest()[:10]
+        key = f"dit{int(round(integtime))}_win{window['w']}x{window['h']}+{window['x']}+{window['y']}_roi{roi_hash}"
+        if temperature is not None:
+            key += f"_T{int(np.floor(temperature / self.temp_bucket))}"
+        return key
+
+    def store(self, dark, temperature=None, roi_stats=None):
+        """
+        Store a master dark (Frame or MasterFrame) under the key of its configuration. Replaces the previous dark of that key.
+        The per-frame ROI values of the dark frames (default: roi_statistics(dark)) are stored along, and attached to
+        the dark as dark.roi_stats. Returns the key.
+        """
+        key = self.key(dark.meandit, dark.window, dark.rois, temperature)
+        if roi_stats is None:
+            roi_stats = roi_statistics(dark)
+        dark.roi_stats = roi_stats
+        self.directory.mkdir(parents=True, exist_ok=True)
+        master, master_std = dark.master_full
+        np.save(self.directory.joinpath(key+".master.npy"), master)
+        np.save(self.directory.joinpath(key+".std.npy"), master_std)
+        meta = {"count": int(getattr(dark, "N", len(dark.ids))),
+                "first_id": dark.ids[0],
+                "last_id": dark.ids[-1],
+                "integtime": float(dark.meandit),
+                "temperature": temperature,
+                "created": time.time(),
+                "roi_stats": roi_stats}
+        # Metadata last: a dark only counts as stored once its metadata is written
+        with open(self.directory.joinpath(key+".json"), "w") as f:
+            json.dump(meta, f)
+        return key
+
+    def lookup(self, integtime, window=None, rois=None, temperature=None, max_age=None):
+        """
+        Matching dark, as a MasterFrame over memory-mapped master and std frames. None if there is no valid dark.
+
+        Parameters
+        ----------
+        max_age : float, optional
+            Overrides the maximal age (s) of the library.
+        """
+        if window is None:
+            window = Frame.window_cfg
+        if rois is None:
+            rois = Frame.rois_cfg
+        key = self.key(integtime, window, rois, temperature)
+        try:
+            with open(self.directory.joinpath(key+".json")) as f:
+                meta = json.load(f)
+            master = np.load(self.directory.joinpath(key+".master.npy"), mmap_mode="r")
+            master_std = np.load(self.directory.joinpath(key+".std.npy"), mmap_mode="r")
+        except (OSError, ValueError):
+            return None
+        max_age = self.max_age if max_age is None else max_age
+        if time.time() - meta["created"] > max_age or meta["count"] < self.min_frames:
+            return None
+        if master.shape != (int(window["h"]), int(window["w"])):
+            return None
+        ids = [meta["first_id"], meta["last_id"]]
+        dark = MasterFrame(master, master_std, meta["count"], ids, [meta["integtime"]], window, rois)
+        dark.roi_stats = meta.get("roi_stats")
+        return dark
+
+    def purge(self, max_age=None):
+        # Remove darks older than max_age (s), by default the maximal age of the library
+        max_age = self.max_age if max_age is None else max_age
+        for path in self.directory.glob("*.json"):
+            try:
+                with open(path) as f:
+                    created = json.load(f)["created"]
+            except (OSError, ValueError, KeyError):
+                continue
+            if time.time() - created > max_age:
+                key = path.name[:-len(".json")]
+                path.unlink()
+                for suffix in (".master.npy", ".std.npy"):
+                    self.directory.joinpath(key+suffix).unlink(missing_ok=True)
+
+
+def roi_statistics(dark):
+    """
+    Mean and error on the mean of the per-frame ROI values (roi<n>_max, _avg and _sum in the database) over the frames
+    of a dark, as {field: [mean, error]}. None if they cannot be read.
+    The mean per-frame max is not the max of the master dark: noise pushes every per-frame max up.
+    """
+    fields = [f"roi{n+1}_{kind}" for n in range(len(dark.rois)) for kind in roi_kinds]
+    try:
+        mean, std, count = get_reduced(fields, id_to_unix_ms(dark.ids[0]), id_to_unix_ms(dark.ids[-1]), ("mean", "std", "count"))
+    except Exception as e:
+        print(f"Failed to read the ROI values of the dark: {e}")
+        return None
+    return {field: [float(mean[k]), float(std[k] / np.sqrt(count[k]))] for k, field in enumerate(fields) if count[k] > 0}
+
+
+def roi_values(dark, fields):
+    """
+    Per-frame ROI values of a dark, for darks on ROI values instead of frames (e.g. HumInt.sample_long_cal).
+
+    Parameters
+    ----------
+    dark : Frame or MasterFrame
+        Master dark, e.g. from DarkLibrary.lookup.
+    fields : list of str or int
+        ROI value fields ("roi<n>_sum", "roi<n>_avg" or "roi<n>_max"), or ROI numbers (sums).
+
+    Returns
+    -------
+    (values, errors) : (fields,) numpy arrays, the per-frame values stored with the dark (see roi_statistics).
+        Sums and averages of darks without stored values are taken from the master dark. None if a max is not stored.
+    """
+    stats = getattr(dark, "roi_stats", None) or {}
+    master, master_std = dark.master_rois
+    values, errors = [], []
+    for field in fields:
+        name = field if isinstance(field, str) else f"roi{field}_sum"
+        number, kind = name[len("roi"):].split("_", 1)
+        roi, roi_std = master[int(number)-1], master_std[int(number)-1]
+        if name in stats:
+            values.append(stats[name][0])
+            errors.append(stats[name][1])
+        elif kind == "avg":
+            values.append(roi.mean())
+            errors.append(np.sqrt(np.square(roi_std).sum()) / roi.size)
+        elif kind == "max":
+            return None
+        else:
+            values.append(roi.sum())
+            errors.append(np.sqrt(np.square(roi_std).sum()))
+    return np.array(values), np.array(errors)
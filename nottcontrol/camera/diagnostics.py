@@ -81,7 +81,8 @@ class Diagnostics(object):
         dt = 5.
         self.human_interf.shutter_set([1,1,1,1],wait=True)
         sci_frames = self.human_interf.science_frame_sequence(dt)
-        dark_frames = self.human_interf.dark_frame_sequence(dt)
+        # Darks are only used through their master frame, a matching dark from the library is reused if available
+        dark_frames = self.human_interf.library_dark(dt)
         self.Nroi = len(sci_frames.rois_data)
         self.dark_frames = dark_frames
         # Full frame
@@ -113,8 +114,15 @@ class Diagnostics(object):
         self.output_top_idx = int(np.min(row_ind))
         self.output_height = int(np.max(row_ind)) - self.output_top_idx+1
 
-    def diagnose(self,dt,visual_feedback=True,visual_feedback_flux=True,custom_lambs=False):
+    def diagnose(self,dt,visual_feedback=True,visual_feedback_flux=True,custom_lambs=False,rectify=False):
+        # rectify : show the dispersed flux of all outputs resampled onto the common wavelength grid, by their own
+        # wavelength solutions (see HumInt.set_resampler), instead of the output rows
     
+        resampler = getattr(self.human_interf, "resampler", None)
+        if rectify and resampler is None:
+            raise Exception("No spectral resampler set, solve the spectral calibration first (HumInt.set_resampler)")
+        if rectify and custom_lambs:
+            raise Exception("Custom wavelengths cannot be used with rectified spectra")
         if custom_lambs:
             lambs = self.pix_to_lamb
             if len(lambs) != self.output_height:
@@ -143,6 +151,12 @@ class Diagnostics(object):
         flux_disp = cal_mean.sum(axis=2)[self.output_top_idx:self.output_top_idx+self.output_height]
         snr_disp = cal_mean_snr.sum(axis=2)[self.output_top_idx:self.output_top_idx+self.output_height]
         flux_disp_err = np.sqrt((cal_mean_std**2).sum(axis=2)[self.output_top_idx:self.output_top_idx+self.output_height])
+        if rectify:
+            # Dispersed flux of all outputs resampled onto the common wavelength grid, errors propagated by the resampler
+            lambs = resampler.grid*1e6
+            flux_disp, flux_disp_err = resampler.apply(cal_mean.sum(axis=2).T, np.sqrt((cal_mean_std**2).sum(axis=2)).T)
+            flux_disp, flux_disp_err = flux_disp.T, flux_disp_err.T
+            snr_disp = np.divide(flux_disp, flux_disp_err)
     
         # Timestamps of individual frames
         ids = sci_frames.ids
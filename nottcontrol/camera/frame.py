@@ -9,13 +9,20 @@ This class provides retrieval and handling of sequences of infrared camera frame
 """
 
 import numpy as np
-from PIL import Image
 from nottcontrol.camera.roi import Roi
 from nottcontrol.camera.brightness_calculator import BrightnessCalculator
+from nottcontrol.camera.frame_store import FrameStoreReader
+from nottcontrol.camera.welford import WelfordAccumulator
+from nottcontrol.camera.calibration import calib_rois_seq, calib_full_seq, calib_rows, fill_bad
+from nottcontrol.camera.robust import combine, BadPixelMap
+from nottcontrol.camera.png_loader import load_pngs, load_range
+from nottcontrol.camera.frame_archive import FrameArchiveReader
+from nottcontrol.camera.roi_gather import gather_rois
 from nottcontrol import config as nott_config
 from pathlib import Path
 from platform import system
 from time import sleep
+from datetime import datetime
 
 
 # Location of frames on the machine
@@ -24,6 +31,23 @@ if system() == "Windows":
 else:
     frame_directory = str(nott_config['DEFAULT']['linux_frame_directory'])
 
+# Combination of frames into master frames (mean, sigma_clip or median_of_means), see camera/robust.py
+master_combine = nott_config['CAMERA']['master_combine']
+# Bad pixels, learned from darks and replaced in calibrated frames
+bad_pixels = BadPixelMap(Path(frame_directory).joinpath("darks", "bad_pixels.npz"))
+use_bad_pixels = (nott_config['CAMERA']['bad_pixel_mask'] == "True")
+
+def known_dits(integtimes):
+    # Mask of the known integration times: missing (legacy PNG frames), NaN or frame_store.unknown_integtime are not
+    integtimes = np.asarray(integtimes, dtype=float)
+    return np.isfinite(integtimes) & (integtimes > 0)
+
+def mean_dit(integtimes):
+    # Mean of the known integration times (us), NaN if there are none
+    integtimes = np.asarray(integtimes, dtype=float)
+    known = known_dits(integtimes)
+    return float(integtimes[known].mean()) if known.any() else np.nan
+
 class Frame(object):
     # This class represents a sequence of frames, taken by the infrared camera.
     
@@ -81,6 +105,18 @@ class Frame(object):
             Note: As this field contains data, it is a numpy array - and not a list - to promote efficiency of data handling.
         """
         
+        # Fetch data from local machine : memory-mapped from the segment store if recorded there (see frame_store.py),
+        # else from the compressed archive (see frame_archive.py), else decoded in parallel from individual PNG files
+        data = FrameStoreReader(frame_directory).read_ids(ids)
+        if data is None:
+            data = FrameArchiveReader(frame_directory).read_ids(ids)
+        if data is None:
+            data = load_pngs(frame_directory, ids)
+        
+        self._init_from_data(ids, integtimes, data, window, rois)
+        
+    def _init_from_data(self, ids, integtimes, data, window=None, rois=None):
+        
         if window is None:
             window = self.window_cfg
         if rois is None:
@@ -92,37 +128,43 @@ class Frame(object):
         self.ids = ids
         # Setting frame integration times
         self.integtimes = integtimes
-        self.meandit = np.mean(integtimes)
+        self.meandit = mean_dit(integtimes)
         # Setting window
         self.window = window
-        # Fetch data from local machine
-        data_cube = []
-        for frame_id in ids:
-            Ymd,HMS = frame_id.split(sep="_")[0],frame_id.split(sep="_")[1]
-            directory = Path(self.frame_directory).joinpath(Ymd)
-            filename = HMS+'.png'
-            img_path = str(Path.joinpath(directory,filename))
-            img = Image.open(img_path)
-            data_slice =  np.asarray(img)
-            data_cube.append(data_slice)
-            
-        self.data = np.array(data_cube)
+        # Setting data
+        self.data = data
         self.width = self.data.shape[2]
         self.height = self.data.shape[1]
         # ROIs
-        rois_crop = []
-        rois_data = []
-        for roi in rois:
-            # ROI positions within windowed frame
-            x,y,w,h = int(round(roi.x-window["x"])),int(round(roi.y-window["y"])),int(round(roi.w)),int(round(roi.h))
-            i1,i2,j1,j2 = y,y+h,x,x+w
-            rois_crop.append(Roi(x,y,w,h,roi.idx))
-            rois_data.append(self.data[:,i1:i2,j1:j2])
-        self.rois = rois
-        self.rois_crop = rois_crop
-        self.rois_data = np.array(rois_data)
+        self.set_rois(rois)
         self.bg_roi_idx = [8,9] # default, overwritten upon calling link_to_channels
      
+    @classmethod
+    def from_range(cls, t_start, t_end, window=None, rois=None, png=False):
+        """
+        Sequence of all frames recorded within [t_start,t_end] (unix ms), from the segment store, else from the compressed archive,
+        else (if png) from legacy PNG files, without per-frame lookups.
+        The PNG fallback scans the day directories, which can hold millions of files: only use it for offline reprocessing.
+        Live PNG recordings are read by frame ID instead (see HumInt.get_frames).
+        Returns None if no frames were found.
+        """
+        data, stamps, integtimes = FrameStoreReader(frame_directory).read_range(t_start, t_end)
+        if data is None:
+            data, stamps, integtimes = FrameArchiveReader(frame_directory).read_range(t_start, t_end)
+        if data is None:
+            if not png:
+                return None
+            # Legacy nights, recorded as PNG files (integration times are not recorded with these)
+            data, ids = load_range(frame_directory, t_start, t_end)
+            if data is None:
+                return None
+            integtimes = []
+        else:
+            ids = [datetime.utcfromtimestamp(stamp/1000).strftime("%Y%m%d_%H%M%S%f")[:-3] for stamp in stamps]
+        frames = cls.__new__(cls)
+        frames._init_from_data(ids, integtimes, data, window, rois)
+        return frames
+
     def set_ids(self,ids):
         self.ids = ids
         return
@@ -174,17 +216,24 @@ class Frame(object):
     def set_rois(self,rois):
         # ROIs
         rois_crop = []
-        rois_data = []
         for roi in rois:
             # ROI positions within windowed frame
             x,y,w,h = int(round(roi.x-self.window["x"])),int(round(roi.y-self.window["y"])),int(round(roi.w)),int(round(roi.h))
-            i1,i2,j1,j2 = y,y+h,x,x+w
             rois_crop.append(Roi(x,y,w,h,roi.idx))
-            rois_data.append(self.data[:,i1:i2,j1:j2])
         self.rois = rois
         self.rois_crop = rois_crop
-        self.rois_data = np.array(rois_data)
+        # All ROIs extracted in one pass over the frames, frame-major (roi,N,h,w)
+        self.rois_data = gather_rois(self.data, rois_crop, "frame")
+        self._rois_layouts = {}
         return
+
+    def rois_layout(self, layout, rows=None):
+        # ROI data in another memory layout ("pixel" : (roi,h,w,N), "rows" : (roi,h,N) row sums), see camera/roi_gather.py.
+        # Extracted from the frames on first use, and kept for the other consumers.
+        key = (layout, None if rows is None else tuple(np.asarray(rows).tolist()))
+        if key not in self._rois_layouts:
+            self._rois_layouts[key] = gather_rois(self.data, self.rois_crop, layout, rows)
+        return self._rois_layouts[key]
         
     def av_full(self):
         # Averaging the full frames, over all DITs
@@ -214,13 +263,10 @@ class Frame(object):
     def master_full(self):
         # Calculates a master frame (=mean counts per DIT; detector integration time) and the corresponding std map
         # Does so for the full camera frame
+        # Mean and std are accumulated in one pass over chunks of frames, without promoting the whole sequence to float64
 
-        # Amount of frames
-        N = len(self.data)
-        # Calculating the master frame from the individual frames
-        master_frame = self.av_full()
-        # Dividing sample std by nr. of frames to get the std on the mean
-        master_frame_std = self.std_full() / np.sqrt(N)
+        # Master frame and sample std divided by sqrt(nr. of frames), i.e. the std on the mean (or their robust equivalents)
+        master_frame,master_frame_std = combine(self.data, master_combine, axis=0)
     
         return master_frame,master_frame_std
     
@@ -231,19 +277,17 @@ class Frame(object):
         
         if hasattr(self, "_master_rois"):
             return self._master_rois
-        # Amount of frames
-        N = len(self.data)
-        # Calculating the master frame from the individual frames
-        master_frame = self.av_rois()
-        # Dividing sample std by nr. of frames to get the std on the mean
-        master_frame_std = self.std_rois() / np.sqrt(N)
+        # Master frame and sample std divided by sqrt(nr. of frames), i.e. the std on the mean (or their robust equivalents)
+        master_frame,master_frame_std = combine(self.rois_data, master_combine, axis=1)
     
         return master_frame,master_frame_std
       
-    def calib_seq(self, dark, flat=None, full=False, dark_mean=None, dark_mean_std=None):
+    def calib_seq(self, dark, flat=None, full=False, dark_mean=None, dark_mean_std=None, out=None, out_std=None):
         # Compute a sequence of calibrated (dark-subtracted, also background-subtracted if not full) individual frames and calculate the corresponding std map for each
         # "dark" and "flat" denote series of dark (shutters closed) and flat (even illumination) frames, are both instances of the Frame class
         # If not full, the average of the two background ROIs (see config.ini) is also subtracted from each ROI.
+        # Calibrated frames and std map are float32, written into "out" and "out_std" if provided (see camera/calibration.py).
+        self._check_dit(dark)
 
         # Mean dark frame and corresponding std frame (only calculated if not provided)
         if dark_mean is None or dark_mean_std is None:
@@ -254,20 +298,11 @@ class Frame(object):
         
         if not full:
             # Calibrate the sequence of frames (= one DIT each; detector integration time), calculate total std (science sample std + dark mean std + mean background error)
-            # Dark subtract
-            cal_seq = self.rois_data - dark_mean[:, np.newaxis, :, :]
-            cal_seq_std = np.hypot(self.std_rois(), dark_mean_std)
-            # Calculate mean dark-subtracted background from background ROIs, for each individual frame in the sequence.
-            N = len(self.bg_roi_idx)
-            cal_meanbg_seq = np.average(cal_seq[self.bg_roi_idx],axis=0)
-            cal_meanbg_seq_err = np.linalg.norm(cal_seq_std[self.bg_roi_idx],axis=0) / N
-            # Background subtract
-            cal_seq = cal_seq - cal_meanbg_seq[np.newaxis, :, :, :]
-            cal_seq_std = np.hypot(cal_seq_std, cal_meanbg_seq_err[np.newaxis, :, :])
+            # Dark subtract, subtract the mean dark-subtracted background of the background ROIs, for each individual frame in the sequence.
+            cal_seq, cal_seq_std = calib_rois_seq(self.rois_data, dark_mean, dark_mean_std, self.bg_roi_idx, out, out_std, bad=self.bad_rois)
         else:
             # Calibrate the sequence of frames (= one DIT each; detector integration time), calculate total std (science sample std + dark mean std)
-            cal_seq = self.data - dark_mean[np.newaxis, :, :]
-            cal_seq_std = np.hypot(self.std_full(), dark_mean_std)
+            cal_seq, cal_seq_std = calib_full_seq(self.data, dark_mean, dark_mean_std, out, out_std, bad=self.bad_full)
 
         return cal_seq, cal_seq_std
 
@@ -275,6 +310,7 @@ class Frame(object):
         # Compute the calibrated (dark-subtracted, also background-subtracted if not full) master frame and calculate the corresponding std map
         # "dark" and "flat" denote series of dark (shutters closed) and flat (even illumination) frames, are both instances of the Frame class
         # If not full, the average of the two background ROIs (see config.ini) is also subtracted from each ROI.
+        self._check_dit(dark)
               
         # Mean dark frame and corresponding std frame (only calculated if not provided)
         if dark_mean is None or dark_mean_std is None:
@@ -290,6 +326,10 @@ class Frame(object):
             # Dark subtract
             cal_mean = sci_mean-dark_mean
             cal_mean_std = np.hypot(sci_mean_std, dark_mean_std)
+            # Bad pixels replaced by the mean of the good pixels in their ROI row
+            if self.bad_rois is not None:
+                fill_bad(cal_mean, self.bad_rois)
+                fill_bad(cal_mean_std, self.bad_rois)
             # Calculate mean dark-subtracted background from background ROIs, for the master frame.
             N = len(self.bg_roi_idx)
             cal_meanbg_mean = np.average(cal_mean[self.bg_roi_idx],axis=0)
@@ -303,16 +343,52 @@ class Frame(object):
             # Calibrate the master science frame (= one DIT; detector integration time), calculate total std (science mean std + dark mean std)
             cal_mean = sci_mean-dark_mean
             cal_mean_std = np.hypot(sci_mean_std, dark_mean_std)
+            if self.bad_full is not None:
+                fill_bad(cal_mean, self.bad_full)
+                fill_bad(cal_mean_std, self.bad_full)
     
         return cal_mean, cal_mean_std
 
-    def calib_seq_nifits_format(self, dark, flat=None):
-        cal_seq, cal_seq_std = self.calib_seq(dark, flat=flat)
-        return cal_seq.sum(axis=-1).transpose((1,2,0)), cal_seq_std.sum(axis=-1).transpose((1,2,0))
+    def calib_seq_nifits_format(self, dark, flat=None, row_mask=None):
+        # Calibrated spectra of each frame (time, wavelength row, output) and their std, computed directly from the raw ROI rows (see camera/calibration.py)
+        # Only the rows in "row_mask" (e.g. the science wavelengths) are computed if given, others are NaN.
+        self._check_dit(dark)
+        dark_mean, dark_mean_std = dark.master_rois
+        row_sums = self.rois_layout("rows", self._mask_rows(row_mask)).transpose((0,2,1))
+        return calib_rows(self.rois_data, dark_mean, dark_mean_std, self.bg_roi_idx, row_mask, master=False, row_sums=row_sums, bad=self.bad_rois)
+
+    def calib_master_nifits_format(self, dark, flat=None, row_mask=None):
+        # Calibrated spectra of the master frame (wavelength row, output) and their std
+        # The master frame is the one of calib_master (master_rois, by the configured combiner)
+        self._check_dit(dark)
+        dark_mean, dark_mean_std = dark.master_rois
+        return calib_rows(self.rois_data, dark_mean, dark_mean_std, self.bg_roi_idx, row_mask, master=True, bad=self.bad_rois,
+                          master_rois=self.master_rois)
 
-    def calib_master_nifits_format(self, dark, flat=None):
-        cal_mean, cal_mean_std = self.calib_master(dark, flat=flat)
-        return cal_mean.sum(axis=-1).transpose((1,0)), cal_mean_std.sum(axis=-1).transpose((1,0))
+    @property
+    def bad_full(self):
+        # Bad pixel mask of the frames (None if not used or not available)
+        if not use_bad_pixels:
+            return None
+        return bad_pixels.full(self.window, self.data.shape[1:])
+
+    @property
+    def bad_rois(self):
+        # Bad pixel mask of the ROIs (None if not used or not available)
+        if not use_bad_pixels:
+            return None
+        return bad_pixels.rois(self.rois_crop, self.window, self.data.shape[1:])
+
+    def _check_dit(self, dark):
+        # Frames and dark should be taken by one and the same integration time, else see calib_rate
+        # (frames or darks of unknown integration time cannot be checked)
+        if len(self.dit_groups()) > 1:
+            print("Warning: frames taken by different integration times, calibrate by calib_rate")
+        elif dark is not None and np.isfinite(dark.meandit) and np.isfinite(self.meandit) and abs(dark.meandit - self.meandit) > 1:
+            print(f"Warning: dark integration time {dark.meandit} us does not match the frames' {self.meandit} us")
+
+    def _mask_rows(self, row_mask):
+        return None if row_mask is None else np.flatnonzero(row_mask)
 
     def calib(self, dark, flat=None, full=False):
         # Function that combines above two into one.
@@ -324,8 +400,169 @@ class Frame(object):
         cal_seq,cal_seq_std = self.calib_seq(dark, flat, full, dark_mean, dark_mean_std)
         return cal_mean, cal_mean_std, cal_seq, cal_seq_std  
 
+    def subset(self, sel):
+        # Frames "sel" (slice or array of indices) of the sequence, as a new Frame (a view on the data for a slice)
+        frames = Frame.__new__(Frame)
+        ids = list(np.array(self.ids)[sel])
+        frames._init_from_data(ids, np.asarray(self.integtimes)[sel], self.data[sel], self.window, self.rois)
+        frames.bg_roi_idx = self.bg_roi_idx
+        return frames
+
+    def dit_groups(self, precision=1.):
+        """
+        Frames grouped by integration time (DIT), rounded to "precision" (us).
+        Returns a list of (dit, sel) pairs, with sel a slice if the frames of that DIT are contiguous, else an array of indices.
+        Frames of unknown DIT are left out; if no DIT is known at all, the whole sequence is one group of DIT NaN.
+        """
+        n = len(self.ids)
+        dits = np.full(n, np.nan)
+        if len(self.integtimes) == n:
+            dits[:] = self.integtimes
+        known = known_dits(dits)
+        if not known.any():
+            if n > 0:
+                print("Warning: integration times of the frames are unknown")
+            return [(np.nan, slice(0, n))]
+        if not known.all():
+            print(f"Warning: {np.count_nonzero(~known)} of {n} frames of unknown integration time are left out")
+        dits = np.round(dits / precision) * precision
+        groups = []
+        for dit in np.unique(dits[known]):
+            idx = np.flatnonzero(dits == dit)
+            if idx[-1] - idx[0] + 1 == len(idx):
+                idx = slice(int(idx[0]), int(idx[-1])+1)
+            groups.append((float(dit), idx))
+        return groups
+
+    def calib_rate(self, darks, master=True, full=False, nifits=False, row_mask=None):
+        """
+        Calibration of a sequence of frames taken with different integration times (DIT), in counts/s.
+        Frames are calibrated per DIT, each DIT with its own dark, and normalised by their DIT.
+
+        Parameters
+        ----------
+        darks : dict (keys: DIT (us), values: dark Frame or MasterFrame) or function of the DIT returning a dark
+            Dark matching each DIT in the sequence (e.g. HumInt.dit_darks).
+        master : bool
+            If True, the master frame: mean count rate of the DIT groups, weighted by their total exposure time (amount of frames x DIT).
+            Else, the count rate of each frame, with the std of its DIT group.
+        full, row_mask :
+            As for calib_master/calib_seq (full frames) and calib_master_nifits_format/calib_seq_nifits_format (nifits).
+        nifits : bool
+            If True, spectra in NIFITS format (see calib_master_nifits_format).
+
+        Returns
+        -------
+        (cal, cal_std) in counts/s, of the layout of calib_master/calib_seq (or their NIFITS variants).
+        For a sequence, the std is given per frame.
+        """
+        groups = self.dit_groups()
+        if not np.isfinite(groups[0][0]):
+            raise ValueError("Integration times of the frames are unknown, count rates cannot be calibrated")
+        get_dark = darks if callable(darks) else (lambda dit: darks[dit])
+        n = len(self.ids)
+        cal, cal_std, weight = 0., 0., 0.
+        for dit, sel in groups:
+            frames = self.subset(sel)
+            dark = get_dark(dit)
+            # DIT in seconds
+            dit_s = dit * 1e-6
+            if master:
+                if nifits:
+                    m, m_std = frames.calib_master_nifits_format(dark, row_mask=row_mask)
+                else:
+                    m, m_std = frames.calib_master(dark, full=full)
+                # Weighted by the total exposure time of the group (= total counts / total time)
+                w = len(frames.ids) * dit_s
+                cal = cal + w * m / dit_s
+                cal_std = cal_std + np.square(w * m_std / dit_s)
+                weight += w
+                continue
+            if nifits:
+                c, c_std = frames.calib_seq_nifits_format(dark, row_mask=row_mask)
+            else:
+                c, c_std = frames.calib_seq(dark, full=full)
+            # Frame axis of the layout, the std maps are extended to all frames of the group
+            if nifits or full:
+                if not isinstance(cal, np.ndarray):
+                    # Frames of unknown DIT stay NaN
+                    cal = np.full((n,)+c.shape[1:], np.nan, dtype=c.dtype)
+                    cal_std = np.full((n,)+c.shape[1:], np.nan, dtype=c.dtype)
+                cal[sel] = c / dit_s
+                cal_std[sel] = (c_std if nifits else c_std[np.newaxis]) / dit_s
+            else:
+                if not isinstance(cal, np.ndarray):
+                    cal = np.full(c.shape[:1]+(n,)+c.shape[2:], np.nan, dtype=c.dtype)
+                    cal_std = np.full(cal.shape, np.nan, dtype=c.dtype)
+                cal[:, sel] = c / dit_s
+                cal_std[:, sel] = c_std[:, np.newaxis] / dit_s
+        if master:
+            return cal / weight, np.sqrt(cal_std) / weight
+        return cal, cal_std
+
     def cache_master_rois(self):
         self._master_rois = self.master_rois
         # self._master_full = self.master_full
       
         
+
+
+class MasterFrame(object):
+    # This class represents the master (mean) frame of a sequence of frames, without holding the sequence itself.
+    # It is accumulated while the frames are being recorded, and can be used wherever only the master of a sequence
+    # is needed, e.g. as dark in Frame.calib_seq / Frame.calib_master.
+
+    def __init__(self, master, master_std, count, ids, integtimes, window=None, rois=None):
+        if window is None:
+            window = Frame.window_cfg
+        if rois is None:
+            rois = Frame.rois_cfg
+        self.frame_directory = frame_directory
+        self.ids = ids
+        self.integtimes = integtimes
+        self.meandit = mean_dit(integtimes)
+        self.window = window
+        self.N = count
+        self.height, self.width = master.shape
+        self._master_full = master, master_std
+        # ROIs : slices of the full master frame
+        rois_crop = []
+        rois_master = []
+        rois_master_std = []
+        for roi in rois:
+            x,y,w,h = int(round(roi.x-window["x"])),int(round(roi.y-window["y"])),int(round(roi.w)),int(round(roi.h))
+            rois_crop.append(Roi(x,y,w,h,roi.idx))
+            rois_master.append(master[y:y+h,x:x+w])
+            rois_master_std.append(master_std[y:y+h,x:x+w])
+        self.rois = rois
+        self.rois_crop = rois_crop
+        self._master_rois = np.array(rois_master), np.array(rois_master_std)
+        self.bg_roi_idx = [8,9]
+
+    @classmethod
+    def from_stream(cls, t_start, t_end, window=None, rois=None):
+        """
+        Master frame of the frames stamped within [t_start,t_end] (unix ms), accumulated while they are being
+        written to the segment store, so that it is ready as soon as the timeframe has passed.
+        Returns None if no frames were found.
+        """
+        acc = WelfordAccumulator()
+        stamps, integtimes = [], []
+        for data, chunk_stamps, chunk_integtimes in FrameStoreReader(frame_directory).follow(t_start, t_end):
+            acc.add_batch(data, axis=0)
+            stamps.append(chunk_stamps)
+            integtimes.append(chunk_integtimes)
+        if acc.count == 0:
+            return None
+        stamps = np.concatenate(stamps)
+        ids = [datetime.utcfromtimestamp(stamp/1000).strftime("%Y%m%d_%H%M%S%f")[:-3] for stamp in stamps]
+        master, master_std = acc.result()
+        return cls(master, master_std, acc.count, ids, np.concatenate(integtimes), window, rois)
+
+    @property
+    def master_full(self):
+        return self._master_full
+
+    @property
+    def master_rois(self):
+        return self._master_rois
@@ -0,0 +1,285 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 22:48:19 2026
+
+Lossless compressed archive of recorded infrared camera frames, with per-frame random access.
+
+Frames are compressed in chunks of "chunk_frames" consecutive frames. Per chunk, every frame row is delta-encoded
+(differences between neighbouring pixels, modulo 2^16), the bytes are shuffled (all low bytes, then all high bytes)
+and the result is compressed by zstd or lz4 if installed, else by zlib. An archive consists of
+    <frame_directory>/<YYYYMMDD>/arc_<HHMMSSmmm>.frames.nfa : concatenated compressed chunks
+    <frame_directory>/<YYYYMMDD>/arc_<HHMMSSmmm>.json       : frame shape and dtype, codec, chunk size and chunk offsets
+    <frame_directory>/<YYYYMMDD>/arc_<HHMMSSmmm>.index.npy  : per-frame records of timestamp (unix ms) and integration time (us),
+                                                             as for the segment store (see frame_store.py)
+The index is written last, so that an archive is only seen by readers once it is complete.
+Reading a frame decodes its chunk only; the chunks of a range of frames are decoded in parallel.
+
+Existing PNG recordings (<YYYYMMDD>/<HHMMSSmmm>.png) are converted by the transcoder:
+    python -m nottcontrol.camera.frame_archive <frame_directory> [YYYYMMDD ...]
+The integration times of the PNG frames are taken from the cam_integtime series in redis; frames without a datapoint
+(or if redis cannot be reached) are indexed with frame_store.unknown_integtime.
+
+"""
+
+import os
+import sys
+import json
+import zlib
+import numpy as np
+from datetime import datetime
+from pathlib import Path
+from concurrent.futures import ThreadPoolExecutor
+from nottcontrol.camera.frame_store import FrameStoreReader, index_dtype, unix_time_ms, unknown_integtime
+from nottcontrol.camera.png_loader import ids_in_range, load_pngs
+from nottcontrol.script.lib.nott_database import ts_range
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
+try:
+    import lz4.frame
+except ImportError:
+    lz4 = None
+
+_pool = None
+
+
+def _threads():
+    global _pool
+    if _pool is None:
+        _pool = ThreadPoolExecutor(max_workers=os.cpu_count() or 1)
+    return _pool
+
+
+def default_codec():
+    if zstandard is not None:
+        return "zstd"
+    if lz4 is not None:
+        return "lz4"
+    return "zlib"
+
+
+def _compress(raw, codec):
+    if codec == "zstd":
+        return zstandard.ZstdCompressor(level=3).compress(raw)
+    if codec == "lz4":
+        return lz4.frame.compress(raw)
+    return zlib.compress(raw, 1)
+
+
+def _decompress(buf, codec):
+    if codec == "zstd":
+        return zstandard.ZstdDecompressor().decompress(buf)
+    if codec == "lz4":
+        return lz4.frame.decompress(buf)
+    return zlib.decompress(buf)
+
+
+def encode_chunk(frames, codec):
+    # (n,h,w) frames to compressed bytes: row delta, byte shuffle, compression
+    delta = np.diff(frames, axis=-1, prepend=np.zeros(frames.shape[:-1]+(1,), dtype=frames.dtype))
+    planes = delta.view(np.uint8).reshape(delta.shape+(frames.dtype.itemsize,))
+    shuffled = np.ascontiguousarray(np.moveaxis(planes, -1, 0))
+    return _compress(shuffled.tobytes(), codec)
+
+
+def decode_chunk(buf, n, shape, dtype, codec, out=None):
+    # Compressed bytes back to (n,h,w) frames, written into out if given
+    dtype = np.dtype(dtype)
+    planes = np.frombuffer(_decompress(buf, codec), dtype=np.uint8).reshape((dtype.itemsize, n)+tuple(shape))
+    delta = np.ascontiguousarray(np.moveaxis(planes, 0, -1)).view(dtype)[..., 0]
+    if out is None:
+        out = np.empty((n,)+tuple(shape), dtype=dtype)
+    np.cumsum(delta, axis=-1, dtype=dtype, out=out)
+    return out
+
+
+class ArchiveFrames(object):
+    # Frames of one archive, decoded upon indexing (frames[k], frames[k1:k2], frames[array of k]).
+
+    def __init__(self, prefix):
+        with open(prefix+".json") as f:
+            self.meta = json.load(f)
+        self.path = prefix+".frames.nfa"
+        self.shape = (self.meta["count"],)+tuple(self.meta["shape"])
+        self.dtype = np.dtype(self.meta["dtype"])
+        self.chunk_frames = self.meta["chunk_frames"]
+
+    def __len__(self):
+        return self.shape[0]
+
+    def __getitem__(self, key):
+        scalar = np.isscalar(key)
+        idx = np.arange(len(self))[key]
+        idx = np.atleast_1d(idx)
+        out = np.empty((len(idx),)+self.shape[1:], dtype=self.dtype)
+        chunk_of = idx // self.chunk_frames
+        with open(self.path, "rb") as f:
+            # Chunks read sequentially, decoded in parallel
+            futures = []
+            for c in np.unique(chunk_of):
+                f.seek(self.meta["offsets"][c])
+                buf = f.read(self.meta["lengths"][c])
+                futures.append(_threads().submit(self._decode, c, buf, idx, chunk_of, out))
+        for future in futures:
+            future.result()
+        return out[0] if scalar else out
+
+    def _decode(self, c, buf, idx, chunk_of, out):
+        n = min(self.chunk_frames, len(self) - c*self.chunk_frames)
+        frames = decode_chunk(buf, n, self.shape[1:], self.dtype, self.meta["codec"])
+        sel = chunk_of == c
+        out[sel] = frames[idx[sel] - c*self.chunk_frames]
+
+
+class FrameArchive(object):
+    # Writes frames into compressed archives, one chunk at a time.
+
+    def __init__(self, base_path, chunk_frames=64, codec=None):
+        """
+        Parameters
+        ----------
+        base_path : string
+            Frame directory, under which the date directories are created.
+        chunk_frames : int
+            Amount of frames per compressed chunk (the unit of decoding).
+        codec : string, optional
+            "zstd", "lz4" or "zlib". The default is the fastest installed one.
+        """
+        self.base_path = base_path
+        self.chunk_frames = chunk_frames
+        self.codec = default_codec() if codec is None else codec
+        self._file = None
+
+    def open(self, timestamp, shape, dtype):
+        """
+        Start a new archive, named after the timestamp (datetime, UTC) of its first frame.
+        """
+        self.close()
+        directory = Path(self.base_path).joinpath(timestamp.strftime("%Y%m%d"))
+        directory.mkdir(parents=True, exist_ok=True)
+        self._prefix = str(directory.joinpath("arc_" + timestamp.strftime("%H%M%S%f")[:-3]))
+        self._file = open(self._prefix+".frames.nfa", "wb")
+        self._meta = {"shape": list(shape), "dtype": np.dtype(dtype).str, "codec": self.codec,
+                      "chunk_frames": self.chunk_frames, "count": 0, "offsets": [], "lengths": []}
+        self._index = []
+
+    def write_chunk(self, buf, stamps, integtimes):
+        """
+        Append one encoded chunk (see encode_chunk) of len(stamps) frames. Only the last chunk of an archive may hold fewer
+        than chunk_frames frames.
+        """
+        self._meta["offsets"].append(self._file.tell())
+        self._meta["lengths"].append(len(buf))
+        self._meta["count"] += len(stamps)
+        self._file.write(buf)
+        self._index.append(np.rec.fromarrays([stamps, integtimes], dtype=index_dtype))
+
+    def append(self, frames, stamps, integtimes):
+        # Encode and append (n,h,w) frames, in chunks
+        for k in range(0, len(frames), self.chunk_frames):
+            self.write_chunk(encode_chunk(frames[k:k+self.chunk_frames], self.codec),
+                             stamps[k:k+self.chunk_frames], integtimes[k:k+self.chunk_frames])
+
+    def close(self):
+        if self._file is None:
+            return
+        self._file.close()
+        self._file = None
+        with open(self._prefix+".json", "w") as f:
+            json.dump(self._meta, f)
+        # Index last: the archive becomes visible to readers
+        index = np.concatenate(self._index) if len(self._index) else np.zeros(0, dtype=index_dtype)
+        np.save(self._prefix+".index.npy", index)
+
+
+class FrameArchiveReader(FrameStoreReader):
+    # Reads frames back from the archives, with the interface of FrameStoreReader (read_range, read_ids, follow).
+
+    prefix = "arc_"
+
+    @staticmethod
+    def _open(prefix):
+        index = np.load(prefix+".index.npy")
+        return ArchiveFrames(prefix), index
+
+
+def recorded_integtimes(stamps):
+    """
+    Integration times (us) of frames stamped at "stamps" (unix ms), from the cam_integtime series in redis, which is
+    written with the frame timestamps. unknown_integtime for frames without datapoint; None if redis cannot be read.
+    """
+    integtimes = np.full(len(stamps), unknown_integtime)
+    if len(stamps) == 0:
+        return integtimes
+    try:
+        points = ts_range("cam_integtime", int(np.min(stamps)), int(np.max(stamps)))
+    except Exception as e:
+        print(f"Failed to read integration times from redis: {e}")
+        return None
+    if len(points) == 0:
+        return integtimes
+    k = np.minimum(np.searchsorted(points[:,0], stamps), len(points)-1)
+    found = points[k,0] == stamps
+    integtimes[found] = points[k[found], 1]
+    return integtimes
+
+
+def transcode_day(base_path, day, chunk_frames=64, codec=None):
+    """
+    Convert the PNG frames of one day directory (YYYYMMDD) into archives, using all cores. A new archive is started
+    whenever the frame size changes. The PNG files are left in place. Integration times are read from redis (see
+    recorded_integtimes), unknown_integtime if unavailable.
+    Returns the amount of frames converted.
+    """
+    t_day = unix_time_ms(datetime.strptime(day, "%Y%m%d"))
+    ids = ids_in_range(base_path, t_day, t_day + 86400000 - 1)
+    archive = FrameArchive(base_path, chunk_frames, codec)
+    codec = archive.codec
+
+    def task(chunk_ids):
+        try:
+            frames = load_pngs(base_path, chunk_ids)
+            groups = [(chunk_ids, frames)]
+        except ValueError:
+            # Frame size changes within the chunk: split it into runs of equal size
+            groups = []
+            for frame_id in chunk_ids:
+                frame = load_pngs(base_path, [frame_id])
+                if len(groups) and groups[-1][1][0].shape == frame[0].shape:
+                    groups[-1][0].append(frame_id)
+                    groups[-1][1].append(frame[0])
+                else:
+                    groups.append(([frame_id], [frame[0]]))
+            groups = [(group_ids, np.array(frames)) for group_ids, frames in groups]
+        return [(group_ids, frames.shape[1:], frames.dtype, encode_chunk(frames, codec)) for group_ids, frames in groups]
+
+    # Chunks are decoded and encoded in parallel, and written in order
+    chunks = [ids[k:k+chunk_frames] for k in range(0, len(ids), chunk_frames)]
+    futures = [_threads().submit(task, chunk_ids) for chunk_ids in chunks]
+    shape = None
+    partial = False
+    redis_available = True
+    for future in futures:
+        for group_ids, group_shape, dtype, buf in future.result():
+            stamps = np.array([unix_time_ms(datetime.strptime(frame_id, "%Y%m%d_%H%M%S%f")) for frame_id in group_ids])
+            # New archive upon a change of frame size, or after a partial chunk (only the last chunk may be partial)
+            if group_shape != shape or partial:
+                archive.open(datetime.strptime(group_ids[0], "%Y%m%d_%H%M%S%f"), group_shape, dtype)
+                shape = group_shape
+            partial = len(group_ids) < chunk_frames
+            # Integration times are not recorded with PNG frames: from redis, as long as it can be reached
+            integtimes = recorded_integtimes(stamps) if redis_available else None
+            if integtimes is None:
+                redis_available = False
+                integtimes = np.full(len(stamps), unknown_integtime)
+            archive.write_chunk(buf, stamps, integtimes)
+    archive.close()
+    return len(ids)
+
+
+if __name__ == "__main__":
+    base_path = sys.argv[1]
+    days = sys.argv[2:] or sorted(path.name for path in Path(base_path).iterdir() if path.is_dir() and path.name.isdigit())
+    for day in days:
+        print(day, transcode_day(base_path, day), "frames")
@@ -0,0 +1,80 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 09:12:44 2026
+
+This class provides a preallocated pool of frame buffers for the infrared camera acquisition.
+
+Every frame delivered by the IRBGrab DLL is copied exactly once, from the DLL-owned memory into the next
+free slot of the pool. Consumers receive numpy views on that slot, so no further allocation or copy is needed
+further down the pipeline (ROI calculations, recording, display).
+
+"""
+
+import ctypes as ct
+import numpy as np
+
+
+class FramePool(object):
+    # Round-robin pool of preallocated frame buffers.
+    # A slot is only overwritten after "depth" newer frames have been stored, so the depth has to exceed the
+    # amount of frames that can be queued downstream at any given moment (see [CAMERA] frame_pool_depth).
+
+    def __init__(self, depth=32, dtype=np.uint16):
+        """
+        Parameters
+        ----------
+        depth : int
+            Amount of frame buffers in the pool.
+        dtype : numpy dtype
+            Data type of the stored frames (IRBGrab image type 2 = uint16).
+        """
+        if depth < 2:
+            raise ValueError("A frame pool needs at least two buffers.")
+        self.depth = depth
+        self.dtype = np.dtype(dtype)
+        self.shape = None
+        self._buffers = None
+        self._next = 0
+        # Total amount of frames stored since (re)allocation
+        self.sequence = 0
+        # Cached ctypes array type, to map the DLL memory without rebuilding the type for every frame
+        self._ctype = None
+
+    def allocate(self, shape):
+        # (Re)allocate the pool for frames of the given (height,width) shape. Called automatically upon a change of camera window.
+        self.shape = tuple(shape)
+        self._buffers = np.zeros((self.depth,)+self.shape, dtype=self.dtype)
+        self._ctype = np.ctypeslib.as_ctypes_type(self.dtype) * int(np.prod(self.shape))
+        self._next = 0
+        self.sequence = 0
+
+    def store_from_address(self, address, shape):
+        """
+        Copy a frame, living at the given memory address (e.g. IRBGrab data pointer), into the next slot.
+
+        Returns
+        -------
+        view : numpy array
+            View on the pool slot that now holds the frame.
+        """
+        if self._buffers is None or tuple(shape) != self.shape:
+            self.allocate(shape)
+        src = np.frombuffer(self._ctype.from_address(address), dtype=self.dtype).reshape(self.shape)
+        return self.store(src)
+
+    def store(self, src):
+        # Copy a frame (numpy array) into the next slot and return the view on that slot.
+        if self._buffers is None or src.shape != self.shape:
+            self.allocate(src.shape)
+        view = self._buffers[self._next]
+        np.copyto(view, src, casting='unsafe')
+        self._next = (self._next + 1) % self.depth
+        self.sequence += 1
+        return view
+
+    @property
+    def latest(self):
+        # View on the most recently stored frame (None if no frame was stored yet)
+        if self.sequence == 0:
+            return None
+        return self._buffers[(self._next - 1) % self.depth]
@@ -0,0 +1,114 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 10:03:27 2026
+
+This class provides a single-producer/single-consumer ring of frame slots, handing frames from the camera
+callback (producer) to the frame processing thread (consumer).
+
+The producer only writes the head index and the consumer only writes the tail index, so no lock is taken
+on the hot path. Frames that do not fit are dropped and counted, instead of silently discarded.
+
+"""
+
+import threading
+import time
+
+
+class FrameRing(object):
+
+    def __init__(self, depth=16):
+        """
+        Parameters
+        ----------
+        depth : int
+            Amount of frame slots in the ring.
+
+        Fields
+        ------
+        overruns : int
+            Amount of frames dropped because the ring was full.
+        underruns : int
+            Amount of pops that timed out on an empty ring.
+        max_occupancy : int
+            Largest amount of frames simultaneously waiting in the ring.
+        """
+        if depth < 1:
+            raise ValueError("A frame ring needs at least one slot.")
+        self.depth = depth
+        # One spare slot distinguishes a full ring from an empty one
+        self._size = depth + 1
+        self._frames = [None] * self._size
+        self._timestamps = [None] * self._size
+        self._sequences = [0] * self._size
+        self._enqueued = [0.] * self._size
+        self._head = 0 # written by the producer only
+        self._tail = 0 # written by the consumer only
+        self._pushed = 0
+        self._wakeup = threading.Event()
+        self.reset_counters()
+
+    def reset_counters(self):
+        self.overruns = 0
+        self.underruns = 0
+        self.max_occupancy = 0
+
+    def __len__(self):
+        return (self._head - self._tail) % self._size
+
+    def push(self, frame, timestamp):
+        """
+        Producer side. Returns the sequence number given to the frame, or None if the frame was dropped.
+        """
+        head = self._head
+        nxt = (head + 1) % self._size
+        self._pushed += 1
+        if nxt == self._tail:
+            self.overruns += 1
+            return None
+        self._frames[head] = frame
+        self._timestamps[head] = timestamp
+        self._sequences[head] = self._pushed
+        self._enqueued[head] = time.perf_counter()
+        # Publishing the slot
+        self._head = nxt
+        occupancy = len(self)
+        if occupancy > self.max_occupancy:
+            self.max_occupancy = occupancy
+        self._wakeup.set()
+        return self._pushed
+
+    def pop(self, timeout=None):
+        """
+        Consumer side. Blocks until a frame is available, or until "timeout" seconds have passed.
+
+        Returns
+        -------
+        (frame, timestamp, sequence, enqueued) tuple, or None upon timeout.
+        A gap in consecutive sequence numbers indicates dropped frames. "enqueued" is the time.perf_counter() time of the push.
+        """
+        deadline = None if timeout is None else time.perf_counter() + timeout
+        while self._tail == self._head:
+            self._wakeup.clear()
+            # The producer may have published in between the check and the clear
+            if self._tail != self._head:
+                break
+            remaining = None if deadline is None else deadline - time.perf_counter()
+            if remaining is not None and remaining <= 0:
+                self.underruns += 1
+                return None
+            self._wakeup.wait(remaining)
+        tail = self._tail
+        item = (self._frames[tail], self._timestamps[tail], self._sequences[tail], self._enqueued[tail])
+        # Releasing the slot
+        self._frames[tail] = None
+        self._tail = (tail + 1) % self._size
+        return item
+
+    def stats(self):
+        # Snapshot of the ring counters
+        return {"depth": self.depth,
+                "occupancy": len(self),
+                "max_occupancy": self.max_occupancy,
+                "pushed": self._pushed,
+                "overruns": self.overruns,
+                "underruns": self.underruns}
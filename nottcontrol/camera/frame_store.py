@@ -0,0 +1,255 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 13:41:52 2026
+
+This class provides an append-only store for recorded infrared camera frames.
+
+Instead of one PNG file per frame, raw uint16 frames are written into large, preallocated segment files.
+Each segment consists of two numpy (.npy) files, memory-mapped while recording:
+    <frame_directory>/<YYYYMMDD>/seg_<HHMMSSmmm>.frames.npy : (capacity, h, w) uint16 frames
+    <frame_directory>/<YYYYMMDD>/seg_<HHMMSSmmm>.index.npy  : (capacity,) records of frame timestamp (unix ms) and integration time (us)
+with <HHMMSSmmm> the time of the first frame in the segment. Unused index records have a zero timestamp.
+When a segment is closed, both files are truncated to the frames actually written.
+Since both files carry a standard .npy header, they can be opened directly with np.load(..., mmap_mode='r').
+
+"""
+
+import numpy as np
+import time
+from datetime import datetime
+from pathlib import Path
+
+index_dtype = np.dtype([("stamp", "<i8"), ("integtime", "<f8")])
+
+# Integration time recorded for frames whose integration time is not known (e.g. transcoded PNG frames without
+# cam_integtime datapoint). Frame treats it, like any non-positive or non-finite value, as missing.
+unknown_integtime = -1.
+
+epoch = datetime.utcfromtimestamp(0)
+
+
+def unix_time_ms(time):
+    return round((time - epoch).total_seconds() * 1000.0)
+
+
+def truncate_npy(path, count):
+    """
+    Shrink the first axis of a .npy file to count entries, in place: the header is rewritten with the new shape
+    (padded to its original length, so that the data offset is unchanged) and the file is cut after the data.
+    """
+    with open(path, "r+b") as f:
+        version = np.lib.format.read_magic(f)
+        if version == (1, 0):
+            shape, fortran_order, dtype = np.lib.format.read_array_header_1_0(f)
+        else:
+            shape, fortran_order, dtype = np.lib.format.read_array_header_2_0(f)
+        offset = f.tell()
+        if count >= shape[0]:
+            return
+        shape = (count,)+tuple(shape[1:])
+        header = repr({"descr": np.lib.format.dtype_to_descr(dtype), "fortran_order": fortran_order, "shape": shape})
+        # Magic string, version and header length field precede the header
+        start = 6 + 2 + (2 if version == (1, 0) else 4)
+        header = header.ljust(offset - start - 1) + "\n"
+        f.seek(start)
+        f.write(header.encode("latin1"))
+        f.truncate(offset + count * int(np.prod(shape[1:], dtype=np.int64)) * dtype.itemsize)
+
+
+class FrameStore(object):
+
+    def __init__(self, base_path, segment_size_mb=512, flush_every=200):
+        """
+        Parameters
+        ----------
+        base_path : string
+            Frame directory, under which the date directories are created.
+        segment_size_mb : int
+            Size of the preallocated segment files (MB). The amount of frames per segment follows from the frame size.
+        flush_every : int
+            Amount of frames after which the written frames are flushed to disk, as one sequential write.
+        """
+        self.base_path = base_path
+        self.segment_size = segment_size_mb * 1024**2
+        self.flush_every = flush_every
+        self._frames = None
+        self._index = None
+        self._date = None
+        self._paths = None
+        self._count = 0
+        self._unflushed = 0
+
+    def _open_segment(self, shape, dtype, timestamp):
+        self.close()
+        directory = Path(self.base_path).joinpath(timestamp.strftime("%Y%m%d"))
+        directory.mkdir(parents=True, exist_ok=True)
+        name = "seg_" + timestamp.strftime("%H%M%S%f")[:-3]
+        frame_bytes = int(np.prod(shape)) * np.dtype(dtype).itemsize
+        capacity = max(1, self.segment_size // frame_bytes)
+        self._paths = (str(directory.joinpath(name+".frames.npy")), str(directory.joinpath(name+".index.npy")))
+        self._frames = np.lib.format.open_memmap(self._paths[0], mode="w+", dtype=dtype, shape=(capacity,)+tuple(shape))
+        self._index = np.lib.format.open_memmap(self._paths[1], mode="w+", dtype=index_dtype, shape=(capacity,))
+        self._date = timestamp.date()
+        self._count = 0
+        self._unflushed = 0
+
+    def append(self, img, timestamp, integtime):
+        """
+        Append one frame to the store.
+
+        Parameters
+        ----------
+        img : numpy array
+            (h,w) frame.
+        timestamp : datetime
+            Frame timestamp (UTC, no timezone info).
+        integtime : float
+            Integration time by which the frame was taken (us).
+
+        Raises a ValueError if the frame is not stamped after the previous one: segments are looked up by binary search
+        on the stamps.
+        """
+        stamp = unix_time_ms(timestamp)
+        if self._frames is not None and self._count > 0 and stamp <= self._index[self._count-1]["stamp"]:
+            raise ValueError(f"Frame stamped {stamp} ms is not later than the previous frame ({self._index[self._count-1]['stamp']} ms)")
+        # New segment when the current one is full, the date changes or the camera window changes
+        if (self._frames is None or self._count == len(self._frames) or self._date != timestamp.date()
+                or self._frames.shape[1:] != img.shape):
+            self._open_segment(img.shape, img.dtype, timestamp)
+        self._frames[self._count] = img
+        # The index record is written last, a reader only considers frames with a valid timestamp
+        self._index[self._count] = (stamp, integtime)
+        self._count += 1
+        self._unflushed += 1
+        if self._unflushed >= self.flush_every:
+            self.flush()
+
+    def flush(self):
+        if self._frames is None:
+            return
+        self._frames.flush()
+        self._index.flush()
+        self._unflushed = 0
+
+    def close(self):
+        if self._frames is None:
+            return
+        self.flush()
+        # Dropping the memmaps unmaps the files before truncating (required on Windows)
+        self._frames = None
+        self._index = None
+        # Recording usually stops long before a segment is full: cut the preallocated files to the written frames.
+        # The frames first, the index last, so that a reader never sees index records without frames.
+        try:
+            truncate_npy(self._paths[0], self._count)
+            truncate_npy(self._paths[1], self._count)
+        except OSError as e:
+            # E.g. still mapped by a reader: the segment stays preallocated, unused records have a zero timestamp
+            print(f"Could not truncate segment {self._paths[1]}: {e}")
+
+
+def id_to_unix_ms(frame_id):
+    # Frame ID ("Y%m%d_H%M%S" string, up to millisecond precision) to unix ms
+    return unix_time_ms(datetime.strptime(frame_id, "%Y%m%d_%H%M%S%f"))
+
+
+class FrameStoreReader(object):
+    # Reads frames back from the segment files written by FrameStore.
+    # Frames that are contiguous within one segment are returned as a view on the memory-mapped segment (no decoding, no copy).
+
+    # File name prefix of the segments
+    prefix = "seg_"
+
+    def __init__(self, base_path):
+        self.base_path = base_path
+
+    def _segments(self, t_start, t_end):
+        # Segments (start unix ms, path prefix) that may hold frames in [t_start,t_end], in chronological order
+        day = datetime.utcfromtimestamp(t_start/1000).date()
+        last_day = datetime.utcfromtimestamp(t_end/1000).date()
+        starts = []
+        while day <= last_day:
+            directory = Path(self.base_path).joinpath(day.strftime("%Y%m%d"))
+            for path in sorted(directory.glob(self.prefix+"*.index.npy")):
+                name = path.name[:-len(".index.npy")]
+                start = unix_time_ms(datetime.strptime(day.strftime("%Y%m%d")+name[len(self.prefix):], "%Y%m%d%H%M%S%f"))
+                starts.append((start, str(path)[:-len(".index.npy")]))
+            day = day.fromordinal(day.toordinal()+1)
+        # A segment ends where the next one starts
+        segments = []
+        for k, (start, prefix) in enumerate(starts):
+            end = starts[k+1][0] if k+1 < len(starts) else np.inf
+            if start <= t_end and end > t_start:
+                segments.append(prefix)
+        return segments
+
+    @staticmethod
+    def _open(prefix):
+        index = np.load(prefix+".index.npy", mmap_mode="r")
+        n = np.count_nonzero(index["stamp"])
+        frames = np.load(prefix+".frames.npy", mmap_mode="r")
+        return frames, index[:n]
+
+    def read_range(self, t_start, t_end):
+        """
+        Frames stamped within [t_start,t_end] (unix ms).
+
+        Returns
+        -------
+        data : (N,h,w) numpy array (memory-mapped view if all frames lie within one segment)
+        stamps : (N,) numpy array of unix ms timestamps
+        integtimes : (N,) numpy array of integration times (us)
+        """
+        datas, indices = [], []
+        for prefix in self._segments(t_start, t_end):
+            frames, index = self._open(prefix)
+            i1 = np.searchsorted(index["stamp"], t_start, side="left")
+            i2 = np.searchsorted(index["stamp"], t_end, side="right")
+            if i2 > i1:
+                datas.append(frames[i1:i2])
+                indices.append(index[i1:i2])
+        if len(datas) == 0:
+            return None, np.zeros(0, dtype=np.int64), np.zeros(0)
+        if len(datas) == 1:
+            data, index = datas[0], indices[0]
+        else:
+            data, index = np.concatenate(datas), np.concatenate(indices)
+        return data, np.array(index["stamp"]), np.array(index["integtime"])
+
+    def follow(self, t_start, t_end, poll=0.05, grace=1000):
+        """
+        Generator following the store while frames within [t_start,t_end] (unix ms) are being recorded.
+        Yields (data, stamps, integtimes) chunks of newly written frames, as soon as they are on disk, and stops once a
+        frame past t_end is written, or "grace" ms after t_end (machine time).
+        """
+        t_next = t_start
+        while True:
+            data, stamps, integtimes = self.read_range(t_next, t_end + grace)
+            done = time.time()*1000 > t_end + grace
+            if data is not None:
+                n = np.searchsorted(stamps, t_end, side="right")
+                if n > 0:
+                    yield data[:n], stamps[:n], integtimes[:n]
+                    t_next = stamps[n-1] + 1
+                done = done or n < len(stamps)
+            if done:
+                return
+            time.sleep(poll)
+
+    def read_ids(self, ids):
+        """
+        Frames with the given frame IDs. Returns None if not all frames are found in the store.
+        """
+        if len(ids) == 0:
+            return None
+        stamps = np.array([id_to_unix_ms(frame_id) for frame_id in ids], dtype=np.int64)
+        data, found, _ = self.read_range(stamps.min(), stamps.max())
+        if data is None:
+            return None
+        pos = np.searchsorted(found, stamps)
+        if np.any(pos >= len(found)) or np.any(found[np.minimum(pos, len(found)-1)] != stamps):
+            return None
+        if len(pos) == len(found) and np.all(pos == np.arange(len(found))):
+            # Requested frames are exactly the stored range: no copy
+            return data
+        return data[pos]
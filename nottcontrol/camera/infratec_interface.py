@@ -8,6 +8,8 @@ Created on Tue Nov 15 17:03:06 2022
 import sys
 import os
 import ctypes,_ctypes
+from nottcontrol import config
+from nottcontrol.camera.frame_pool import FramePool
 
 # infratec packages
 # try importing as namespace package
@@ -27,6 +29,8 @@ class InfratecInterface:
     def __init__(self):
         self.load_dll()
         self.create_device()
+        # Preallocated buffers into which every grabbed frame is copied once
+        self.frame_pool = FramePool(config['CAMERA'].getint('frame_pool_depth'))
         
 
     def load_dll(self):
@@ -139,7 +143,7 @@ class InfratecInterface:
         return maximum
     
     def get_image(self):
-        return Image(self.irbgrab_object)
+        return Image(self.irbgrab_object, self.frame_pool)
     
     def extract_parameter_result(self, res):
         if hirb.TIRBG_RetDef[res[0]]=='Success':
@@ -232,11 +236,20 @@ class InfratecInterface:
             raise Exception(hirb.TIRBG_RetDef[res]) 
     
 class Image:
-    def __init__(self, irbgrab):
+    def __init__(self, irbgrab, frame_pool=None):
         self._irbgrab = irbgrab
+        self._frame_pool = frame_pool
     
     def __enter__(self):
-        self.image_data = self._irbgrab.get_data_easy_noFree(2)
+        if self._frame_pool is None:
+            self.image_data = self._irbgrab.get_data_easy_noFree(2)
+            return self
+        # Single copy from the DLL memory into the frame pool; the image data is a view on the pool slot
+        res = self._irbgrab.get_dataptr_easy_noFree(2)
+        if hirb.TIRBG_RetDef[res[0]] == 'Success':
+            self.image_data = (res[0], self._frame_pool.store_from_address(res[1], res[2]))
+        else:
+            self.image_data = res
         return self
         
     def __exit__(self, *args):
@@ -461,7 +461,20 @@ class irbgrab_obj(object):
                 else: return (ptr[0],)
             else: return (dim[0],)
         else: return (res,)
-    
+
+    def get_dataptr_easy_noFree(self,img_type): #wie get_data_easy_noFree, aber ohne Kopie: Adresse bleibt gültig bis free_mem
+        res=self.get_data(img_type)
+        if int(res,16)==hirb.IRBG_RET_SUCCESS:
+            dim=self.get_dimensions()
+            if int(dim[0],16)==hirb.IRBG_RET_SUCCESS:
+                img_shape=(dim[2],dim[1])
+                ptr=self.get_dataptr()
+                if int(ptr[0],16)==hirb.IRBG_RET_SUCCESS:
+                    return (hex(hirb.IRBG_RET_SUCCESS), ptr[1], img_shape)
+                else: return (ptr[0],)
+            else: return (dim[0],)
+        else: return (res,)
+
     '''Ende Bildeinzug'''
     
     def isinit(self):
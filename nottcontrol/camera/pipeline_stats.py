@@ -0,0 +1,178 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 17:08:44 2026
+
+Latency instrumentation of the camera pipeline.
+
+Each stage of a frame's way through the camera GUI records its latency into a log-linear histogram (in the manner
+of an HDR histogram): 32 linear sub-buckets per power of two of microseconds, i.e. a relative precision of ~3%
+from 1 us up to minutes, at a fixed memory cost and an O(1) recording cost. The stages are
+    callback : IRBGrab callback entry -> frame queued for processing
+    queue    : frame queued -> ROI values computed
+    redis    : ROI values (or integration time) handed to the Redis writer -> written to Redis (batch flushed)
+    record   : frame queued -> frame handed to the recorder (PNG file written, or frame copied into the memory-mapped
+               segment of the frame store, which the operating system writes to disk later)
+Dropped frames are counted separately. The "Stats" request also returns the state of the frame ring and of the Redis writer.
+
+Running this module polls the statistics of a running camera GUI:
+    python -m nottcontrol.camera.pipeline_stats [host] [interval (s)]
+
+"""
+
+import json
+import sys
+import threading
+import time
+import zmq
+
+SUB_BUCKETS = 32
+SUB_BITS = 5
+MAX_EXPONENT = 32 # up to 2^37 us
+
+
+class LatencyHistogram(object):
+
+    def __init__(self):
+        self._counts = [0] * (SUB_BUCKETS * (MAX_EXPONENT + 2))
+        self.reset()
+
+    def reset(self):
+        for i in range(len(self._counts)):
+            self._counts[i] = 0
+        self.count = 0
+        self.total = 0.
+        self.max = 0.
+
+    @staticmethod
+    def _index(us):
+        if us < SUB_BUCKETS:
+            return us
+        e = min(us.bit_length() - SUB_BITS - 1, MAX_EXPONENT)
+        return SUB_BUCKETS + e*SUB_BUCKETS + min((us >> e) - SUB_BUCKETS, SUB_BUCKETS - 1)
+
+    @staticmethod
+    def _value(index):
+        # Midpoint of a bucket (us)
+        if index < SUB_BUCKETS:
+            return float(index)
+        e, m = divmod(index - SUB_BUCKETS, SUB_BUCKETS)
+        return ((SUB_BUCKETS + m) + 0.5) * 2**e
+
+    def record(self, seconds):
+        """
+        Record one latency (s). Negative latencies (clock jitter) are recorded as zero.
+        """
+        us = int(seconds * 1e6) if seconds > 0 else 0
+        self._counts[self._index(us)] += 1
+        self.count += 1
+        self.total += us
+        if us > self.max:
+            self.max = us
+
+    def percentile(self, p, counts=None, count=None):
+        # Latency (ms) below which a fraction p (0-100) of the recorded latencies lie
+        counts = self._counts if counts is None else counts
+        count = self.count if count is None else count
+        if count == 0:
+            return 0.
+        target = p / 100. * count
+        cumulative = 0
+        for index, n in enumerate(counts):
+            cumulative += n
+            if n > 0 and cumulative >= target:
+                return self._value(index) * 1e-3
+        return self.max * 1e-3
+
+    def snapshot(self):
+        # Summary in ms. Copies the counts first, so that recording can go on meanwhile.
+        counts = list(self._counts)
+        count = sum(counts)
+        return {"count": count,
+                "mean": self.total / max(self.count, 1) * 1e-3,
+                "p50": self.percentile(50, counts, count),
+                "p90": self.percentile(90, counts, count),
+                "p99": self.percentile(99, counts, count),
+                "p99.9": self.percentile(99.9, counts, count),
+                "max": self.max * 1e-3}
+
+
+class PipelineStats(object):
+
+    stages = ("callback", "queue", "redis", "record")
+
+    def __init__(self):
+        self.histograms = {stage: LatencyHistogram() for stage in self.stages}
+        self._drop_sources = []
+        self._lock = threading.Lock()
+
+    def record(self, stage, seconds):
+        self.histograms[stage].record(seconds)
+
+    def add_drop_source(self, source):
+        # Callable returning an amount of dropped frames (e.g. the overruns of the frame ring)
+        self._drop_sources.append(source)
+
+    def drops(self):
+        return sum(source() for source in self._drop_sources)
+
+    def reset(self):
+        with self._lock:
+            for histogram in self.histograms.values():
+                histogram.reset()
+
+    def snapshot(self):
+        with self._lock:
+            stats = {stage: self.histograms[stage].snapshot() for stage in self.stages}
+        stats["drops"] = self.drops()
+        return stats
+
+    @staticmethod
+    def format(stats):
+        lines = [f"{'stage':>9} {'count':>9} {'mean':>8} {'p50':>8} {'p99':>8} {'p99.9':>8} {'max':>8}  (ms)"]
+        for stage in PipelineStats.stages:
+            s = stats[stage]
+            lines.append(f"{stage:>9} {s['count']:>9d} {s['mean']:>8.2f} {s['p50']:>8.2f} {s['p99']:>8.2f} {s['p99.9']:>8.2f} {s['max']:>8.2f}")
+        lines.append(f"{'dropped':>9} {stats['drops']:>9d}")
+        ring = stats.get("ring")
+        if ring is not None:
+            lines.append(f"Frame ring: {ring['occupancy']}/{ring['depth']} queued, max {ring['max_occupancy']}, {ring['overruns']} dropped")
+        writer = stats.get("writer")
+        if writer is not None:
+            lines.append(f"Redis writer: {writer['queue_depth']} frames queued (max {writer['max_queue_depth']}), "
+                         f"flush {writer['last_flush_latency']:.1f} ms (max {writer['max_flush_latency']:.1f} ms), "
+                         f"{writer['errors']} failed flushes, {writer['failed_samples']} rejected samples")
+        return "\n".join(lines)
+
+
+def _connect(context, host):
+    socket = context.socket(zmq.REQ)
+    socket.setsockopt(zmq.RCVTIMEO, 2000)
+    socket.setsockopt(zmq.LINGER, 0)
+    socket.connect(f"tcp://{host}:65535")
+    return socket
+
+
+def poll(host="localhost", interval=5.):
+    # Poll the camera GUI for its pipeline statistics (zmq "Stats" request)
+    context = zmq.Context()
+    socket = _connect(context, host)
+    try:
+        while True:
+            socket.send_string("Stats")
+            try:
+                print(PipelineStats.format(json.loads(socket.recv_string())))
+            except zmq.error.Again:
+                # A REQ socket without reply cannot send again
+                print("No reply from the camera GUI")
+                socket.close()
+                socket = _connect(context, host)
+            print()
+            time.sleep(interval)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        socket.close()
+
+
+if __name__ == "__main__":
+    poll(*sys.argv[1:2], *[float(arg) for arg in sys.argv[2:3]])
@@ -0,0 +1,129 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 22:10:37 2026
+
+Batch loader for frames recorded as individual 16-bit PNG files (frame_format "png", see scify.py):
+    <frame_directory>/<%Y%m%d>/<%H%M%S + milliseconds>.png
+
+The files are decoded in parallel by a pool of threads (OpenCV releases the GIL while decoding, PIL is the fallback)
+straight into a preallocated (N,h,w) cube, so that reprocessing of old nights scales with the amount of cores.
+
+"""
+
+import os
+import numpy as np
+from datetime import datetime, timedelta, timezone
+from pathlib import Path
+from concurrent.futures import ThreadPoolExecutor
+from PIL import Image
+try:
+    import cv2
+except ImportError:
+    cv2 = None
+
+_pool = None
+
+
+def _threads():
+    global _pool
+    if _pool is None:
+        _pool = ThreadPoolExecutor(max_workers=os.cpu_count() or 1)
+    return _pool
+
+
+def png_path(directory, frame_id):
+    # Path of the PNG file of a frame ID ("%Y%m%d_%H%M%S" + milliseconds)
+    Ymd, HMS = frame_id.split(sep="_")
+    return Path(directory).joinpath(Ymd, HMS+".png")
+
+
+def decode(path, out=None):
+    """
+    Decode one PNG file, keeping its bit depth. If out is given, the frame is written into it.
+    """
+    img = None
+    if cv2 is not None:
+        img = cv2.imread(str(path), cv2.IMREAD_UNCHANGED)
+    if img is None:
+        # No OpenCV, or a file OpenCV cannot read
+        img = np.asarray(Image.open(path))
+    if out is None:
+        return img
+    out[...] = img
+    return out
+
+
+def load_pngs(directory, ids, out=None, chunk=16):
+    """
+    Parameters
+    ----------
+    directory : string
+        Frame directory.
+    ids : list of strings
+        Frame IDs.
+    out : (N,h,w) numpy array, optional
+        Buffer for the frames. The default has the size and dtype of the first frame.
+    chunk : int
+        Amount of files decoded per task.
+
+    Returns
+    -------
+    out : (N,h,w) numpy array
+    """
+    paths = [png_path(directory, frame_id) for frame_id in ids]
+    if len(paths) == 0:
+        return out
+    first = decode(paths[0])
+    if out is None:
+        out = np.empty((len(paths),)+first.shape, dtype=first.dtype)
+    out[0] = first
+
+    def task(k1, k2):
+        for k in range(k1, k2):
+            decode(paths[k], out[k])
+
+    futures = [_threads().submit(task, k, min(k+chunk, len(paths))) for k in range(1, len(paths), chunk)]
+    for future in futures:
+        future.result()
+    return out
+
+
+def ids_in_range(directory, t_start, t_end):
+    """
+    IDs of the PNG frames within [t_start,t_end] (unix ms, UTC), in chronological order.
+    Lists the whole day directories: meant for offline reprocessing, not for live acquisition.
+    """
+    start = datetime.fromtimestamp(t_start/1000, tz=timezone.utc)
+    end = datetime.fromtimestamp(t_end/1000, tz=timezone.utc)
+    ids = []
+    day = start.date()
+    while day <= end.date():
+        Ymd = day.strftime("%Y%m%d")
+        midnight = datetime(day.year, day.month, day.day, tzinfo=timezone.utc).timestamp()*1000
+        day_dir = Path(directory).joinpath(Ymd)
+        if day_dir.is_dir():
+            for path in day_dir.glob("*.png"):
+                HMS = path.stem
+                try:
+                    t = midnight + ((int(HMS[0:2])*60 + int(HMS[2:4]))*60 + int(HMS[4:6]))*1000 + int(HMS[6:9])
+                except ValueError:
+                    continue
+                if t_start <= t <= t_end:
+                    ids.append((t, Ymd+"_"+HMS))
+        day += timedelta(days=1)
+    ids.sort()
+    return [frame_id for _, frame_id in ids]
+
+
+def load_range(directory, t_start, t_end):
+    """
+    All PNG frames within [t_start,t_end] (unix ms).
+
+    Returns
+    -------
+    (data, ids) : (N,h,w) numpy array and the frame IDs; (None, []) if no frames were found.
+    """
+    ids = ids_in_range(directory, t_start, t_end)
+    if len(ids) == 0:
+        return None, []
+    return load_pngs(directory, ids), ids
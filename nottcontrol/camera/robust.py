@@ -0,0 +1,180 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 21:05:12 2026
+
+Robust combination of sequences of frames into master frames, and a persistent bad-pixel mask.
+
+A plain mean lets a single cosmic or flickering hot pixel spoil the master frame of that pixel. Two robust
+combiners are provided, both streaming over chunks of frames so that memory use stays O(pixels):
+    sigma_clip      : iterative sigma clipping, one pass over the frames per iteration
+    median_of_means : median of the means of "nblocks" consecutive blocks of frames
+Pixels that are hot, dead or noisy in dark stacks are flagged in a BadPixelMap, which is kept on disk and
+learned from every new dark. The calibration kernels (camera/calibration.py) replace flagged pixels by the mean
+of the good pixels in the same ROI row.
+
+"""
+
+import numpy as np
+from pathlib import Path
+from nottcontrol.camera.welford import WelfordAccumulator
+
+combiners = ("mean", "sigma_clip", "median_of_means")
+
+
+def _chunks(frames, axis, chunk):
+    n = frames.shape[axis]
+    for k in range(0, n, chunk):
+        yield frames[(slice(None),)*axis + (slice(k, k+chunk),)]
+
+
+def sigma_clip(frames, axis=0, nsigma=3., iterations=3, chunk=64):
+    """
+    Iteratively sigma-clipped master frame.
+
+    Returns
+    -------
+    (master, master_std) : per-pixel mean of the kept frames and its std (std of the kept frames / sqrt(amount kept)).
+    """
+    acc = WelfordAccumulator()
+    acc.add_batch(frames, axis=axis, chunk=chunk)
+    mean, std = acc.mean, acc.std()
+    count = np.full(mean.shape, acc.count, dtype=np.int64)
+    for _ in range(iterations):
+        s = np.zeros(mean.shape)
+        s2 = np.zeros(mean.shape)
+        kept = np.zeros(mean.shape, dtype=np.int64)
+        # Deviations are taken relative to the previous mean, for numerical stability
+        for block in _chunks(frames, axis, chunk):
+            dev = block - np.expand_dims(mean, axis)
+            keep = np.abs(dev) <= nsigma * np.expand_dims(std, axis)
+            dev = np.where(keep, dev, 0.)
+            s += dev.sum(axis=axis)
+            s2 += np.square(dev).sum(axis=axis)
+            kept += keep.sum(axis=axis)
+        # Pixels without any kept frame keep their previous estimate
+        valid = kept > 0
+        safe = np.maximum(kept, 1)
+        shift = np.where(valid, s / safe, 0.)
+        new_std = np.sqrt(np.maximum(s2 / safe - shift**2, 0.))
+        mean = mean + shift
+        std = np.where(valid, new_std, std)
+        converged = np.array_equal(kept[valid], count[valid])
+        count = np.where(valid, kept, count)
+        if converged:
+            break
+    return mean, std / np.sqrt(np.maximum(count, 1))
+
+
+def median_of_means(frames, axis=0, nblocks=5, chunk=64):
+    """
+    Median of the means of "nblocks" consecutive blocks of frames. A transient (cosmic, flicker) only affects one block.
+
+    Returns
+    -------
+    (master, master_std) : median of the block means and its std (~1.2533 * std of the block means / sqrt(nblocks)).
+    """
+    n = frames.shape[axis]
+    nblocks = max(1, min(nblocks, n))
+    if nblocks == 1:
+        return combine(frames, "mean", axis=axis)
+    edges = np.linspace(0, n, nblocks+1).astype(int)
+    means = []
+    for b in range(nblocks):
+        block = frames[(slice(None),)*axis + (slice(edges[b], edges[b+1]),)]
+        acc = WelfordAccumulator()
+        acc.add_batch(block, axis=axis, chunk=chunk)
+        means.append(acc.mean)
+    means = np.array(means)
+    master = np.median(means, axis=0)
+    return master, 1.2533 * means.std(axis=0, ddof=1) / np.sqrt(nblocks)
+
+
+def combine(frames, method="mean", axis=0, **kwargs):
+    # Master frame and its std by the given combiner
+    if method == "sigma_clip":
+        return sigma_clip(frames, axis=axis, **kwargs)
+    if method == "median_of_means":
+        return median_of_means(frames, axis=axis, **kwargs)
+    if method != "mean":
+        raise ValueError(f"Unknown combiner {method}, expected one of {combiners}")
+    acc = WelfordAccumulator()
+    acc.add_batch(frames, axis=axis)
+    return acc.result()
+
+
+def _outliers(values, nsigma):
+    # Values deviating by more than nsigma robust (MAD-based) standard deviations from the median
+    median = np.median(values)
+    mad = 1.4826 * np.median(np.abs(values - median))
+    if mad == 0:
+        return np.zeros(values.shape, dtype=bool)
+    return np.abs(values - median) > nsigma * mad
+
+
+class BadPixelMap(object):
+    # Persistent mask of bad pixels in the (windowed) camera frame: True for bad pixels.
+    # The mask is only valid for the camera window (x, y, w, h) it was learned in, which is kept along.
+
+    def __init__(self, path, nsigma=6.):
+        """
+        Parameters
+        ----------
+        path : string
+            File (.npz) in which the mask and its window are kept.
+        nsigma : float
+            Threshold, in robust standard deviations, for flagging hot and noisy pixels.
+        """
+        self.path = Path(path)
+        self.nsigma = nsigma
+        try:
+            with np.load(self.path) as stored:
+                self.mask = stored["mask"]
+                self.window = tuple(int(v) for v in stored["window"])
+        except (OSError, ValueError, KeyError):
+            self.mask = None
+            self.window = None
+
+    @staticmethod
+    def _window(window):
+        # Camera window dictionary to a (x, y, w, h) tuple
+        return tuple(int(window[key]) for key in ("x", "y", "w", "h"))
+
+    def learn(self, master, master_std, window):
+        """
+        Flag hot (master dark), noisy or flickering (std) and dead (zero std) pixels of a master dark taken in the
+        given camera window, in addition to the pixels flagged before. A change of camera window starts a new mask.
+        """
+        hot = _outliers(master, self.nsigma)
+        noisy = _outliers(master_std, self.nsigma) & (master_std > np.median(master_std))
+        dead = (master_std == 0)
+        bad = hot | noisy | dead
+        window = self._window(window)
+        if self.mask is None or self.window != window or self.mask.shape != bad.shape:
+            self.mask = bad
+            self.window = window
+        else:
+            self.mask = self.mask | bad
+        return self.mask
+
+    def save(self):
+        self.path.parent.mkdir(parents=True, exist_ok=True)
+        np.savez(self.path, mask=self.mask, window=np.array(self.window))
+
+    def reset(self):
+        self.mask = None
+        self.window = None
+        self.path.unlink(missing_ok=True)
+
+    def full(self, window, shape):
+        # Mask for frames of the given camera window and shape, None if there is no mask learned in that window
+        if (self.mask is None or self.window != self._window(window) or self.mask.shape != tuple(shape)
+                or not self.mask.any()):
+            return None
+        return self.mask
+
+    def rois(self, rois_crop, window, shape):
+        # (roi,h,w) mask of the ROIs, None if there is no mask learned in that window
+        mask = self.full(window, shape)
+        if mask is None:
+            return None
+        return np.array([mask[roi.y:roi.y+roi.h, roi.x:roi.x+roi.w] for roi in rois_crop])
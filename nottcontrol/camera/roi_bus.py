@@ -0,0 +1,218 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 16:24:37 2026
+
+This class publishes per-frame ROI statistics of the camera process into a shared-memory ring, from which local
+processes (alignment, calibration, human interface) read them directly, without a round trip to the Redis database.
+
+The ring lives in a memory-mapped file in /dev/shm (the temporary directory on systems without /dev/shm):
+    header (4096 bytes) : int64 magic, creation time (ns), capacity, amount of fields, amount of published frames,
+                          followed by the JSON list of field names (e.g. "roi1_avg", "cam_integtime")
+    records             : (capacity,) records of sequence number, frame timestamp (unix ms) and field values
+Each record is protected by its own seqlock: the writer marks a record odd (2n+1) while writing frame n into it
+and even (2n+2) once done. A reader copies the records and keeps those whose sequence number was even, and
+unchanged, before and after the copy. The writer never waits on readers.
+
+"""
+
+import json
+import os
+import tempfile
+import time
+import numpy as np
+
+MAGIC = 0x4e4f5454524f4942 # "NOTTROIB"
+HEADER_SIZE = 4096
+HEADER_FIELDS = 5 # magic, creation time, capacity, nfields, count
+
+
+def default_path(name="nott_roi_bus"):
+    directory = "/dev/shm" if os.path.isdir("/dev/shm") else tempfile.gettempdir()
+    return os.path.join(directory, name)
+
+
+def record_dtype(nfields):
+    return np.dtype([("seq", "<i8"), ("stamp", "<i8"), ("values", "<f8", (nfields,))])
+
+
+class RoiBus(object):
+    # Writer side, owned by the camera process
+
+    def __init__(self, fields, capacity=65536, path=None):
+        """
+        Parameters
+        ----------
+        fields : list of str
+            Names of the values published per frame, in order.
+        capacity : int
+            Amount of frames kept in the ring (65536 frames ~ 5 min at 200 Hz).
+        path : str
+            Path of the shared-memory file. The default is /dev/shm/nott_roi_bus.
+        """
+        self.fields = list(fields)
+        self.capacity = capacity
+        self.path = default_path() if path is None else path
+        names = json.dumps(self.fields).encode()
+        if len(names) > HEADER_SIZE - 8*HEADER_FIELDS:
+            raise ValueError("Too many fields for the ROI bus header.")
+        dtype = record_dtype(len(self.fields))
+        # Always a fresh file: readers attached to a previous ring notice the new file and reopen
+        tmp_path = self.path + ".tmp"
+        with open(tmp_path, "wb") as f:
+            f.truncate(HEADER_SIZE + capacity*dtype.itemsize)
+        self._header = np.memmap(tmp_path, dtype="<i8", mode="r+", shape=(HEADER_FIELDS,))
+        raw = np.memmap(tmp_path, dtype=np.uint8, mode="r+", offset=8*HEADER_FIELDS, shape=(len(names),))
+        raw[:] = np.frombuffer(names, dtype=np.uint8)
+        raw.flush()
+        self._records = np.memmap(tmp_path, dtype=dtype, mode="r+", offset=HEADER_SIZE, shape=(capacity,))
+        self._header[:] = (MAGIC, time.time_ns(), capacity, len(self.fields), 0)
+        os.replace(tmp_path, self.path)
+        self.count = 0
+
+    def publish(self, stamp, values):
+        """
+        Publish the values of one frame.
+
+        Parameters
+        ----------
+        stamp : int
+            Frame timestamp (unix ms), as written to the database.
+        values : sequence of float
+            Values, in the order of the fields.
+        """
+        n = self.count
+        record = self._records[n % self.capacity]
+        record["seq"] = 2*n + 1
+        record["stamp"] = stamp
+        record["values"] = values
+        record["seq"] = 2*n + 2
+        self.count = n + 1
+        self._header[4] = self.count
+
+    def close(self):
+        self._records = None
+        self._header = None
+
+
+class RoiBusReader(object):
+    # Reader side, for any local process. Attaches lazily, and re-attaches when the camera process restarts the bus.
+
+    def __init__(self, path=None):
+        self.path = default_path() if path is None else path
+        self._inode = None
+        self._header = None
+        self._records = None
+        self.fields = []
+
+    def _attach(self):
+        # True if the bus is available. A restarted bus is a new file, recognised by its inode.
+        try:
+            inode = os.stat(self.path).st_ino
+        except OSError:
+            self._header = None
+            return False
+        if self._header is not None and inode == self._inode:
+            return True
+        try:
+            header = np.memmap(self.path, dtype="<i8", mode="r", shape=(HEADER_FIELDS,))
+        except (OSError, ValueError):
+            self._header = None
+            return False
+        if header[0] != MAGIC:
+            self._header = None
+            return False
+        capacity, nfields = int(header[2]), int(header[3])
+        raw = np.memmap(self.path, dtype=np.uint8, mode="r", offset=8*HEADER_FIELDS, shape=(HEADER_SIZE - 8*HEADER_FIELDS,))
+        names = bytes(raw).split(b"\0", 1)[0]
+        self.fields = json.loads(names.decode())
+        self._records = np.memmap(self.path, dtype=record_dtype(nfields), mode="r", offset=HEADER_SIZE, shape=(capacity,))
+        self._header = header
+        self._inode = inode
+        return True
+
+    def available(self, field=None):
+        if not self._attach():
+            return False
+        return field is None or field in self.fields
+
+    def _count(self):
+        return int(self._header[4])
+
+    def latest(self):
+        # Timestamp (unix ms) of the most recently published frame, or None
+        if not self._attach() or self._count() == 0:
+            return None
+        n = self._count() - 1
+        return int(self._records[n % len(self._records)]["stamp"])
+
+    def live(self, max_age):
+        # True if a frame was published within the last max_age seconds (a bus left behind by a stopped camera process is not)
+        latest = self.latest()
+        return latest is not None and time.time()*1000 - latest <= max_age*1000
+
+    def _search(self, t, first, count, side):
+        # Binary search of stamp t over the published frames [first,count), without copying the ring
+        stamps = self._records["stamp"]
+        capacity = len(self._records)
+        lo, hi = first, count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            stamp = stamps[mid % capacity]
+            if stamp < t or (side == "right" and stamp == t):
+                lo = mid + 1
+            else:
+                hi = mid
+        return lo
+
+    def read_range(self, t0, t1, fields=None):
+        """
+        Values of the frames stamped within [t0,t1] (unix ms).
+
+        Parameters
+        ----------
+        fields : list of str, optional
+            Fields to return. The default is all fields.
+
+        Returns
+        -------
+        stamps : (N,) numpy array of unix ms timestamps, or None if the bus is not available
+        values : (N,nfields) numpy array
+        """
+        if not self._attach():
+            return None, None
+        count = self._count()
+        capacity = len(self._records)
+        first = max(0, count - capacity)
+        n1 = self._search(t0, first, count, "left")
+        n2 = self._search(t1, n1, count, "right")
+        slots = np.arange(n1, n2) % capacity
+        records = self._records[slots]
+        expected = 2*np.arange(n1, n2) + 2
+        # Seqlock check: records being written, or overwritten during the copy, are left out
+        valid = (records["seq"] == expected) & (self._records["seq"][slots] == expected)
+        records = records[valid]
+        values = records["values"]
+        if fields is not None:
+            values = values[:, [self.fields.index(field) for field in fields]]
+        return records["stamp"].copy(), values
+
+    def covers(self, t0):
+        # True if the ring still holds the frames from t0 onwards
+        if not self._attach() or self._count() == 0:
+            return False
+        first = max(0, self._count() - len(self._records))
+        return int(self._records[first % len(self._records)]["stamp"]) <= t0
+
+    def wait_until(self, t, timeout=1.0, poll=2e-4):
+        """
+        Block until a frame stamped at or after t (unix ms) has been published, or until "timeout" seconds have passed.
+        Returns True if such a frame is available.
+        """
+        deadline = time.perf_counter() + timeout
+        while True:
+            latest = self.latest()
+            if latest is not None and latest >= t:
+                return True
+            if time.perf_counter() >= deadline:
+                return False
+            time.sleep(poll)
@@ -0,0 +1,81 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 20:21:40 2026
+
+Extraction of all ROIs from a sequence of raw frames, in one pass over the frames, into the memory layout that
+suits the consumer:
+    "frame" : (roi,N,h,w) frame-major, as Frame.rois_data
+    "pixel" : (roi,h,w,N) time series of each pixel contiguous, for per-pixel statistics over the sequence
+    "rows"  : (roi,h,N) ROI rows summed over the ROI width (raw spectra), for per-wavelength processing
+The frames are read chunk by chunk, and all ROIs of a chunk are extracted by a single gather.
+
+"""
+
+import numpy as np
+
+layouts = ("frame", "pixel", "rows")
+
+
+def roi_index(rois_crop, shape, rows=None):
+    """
+    Row and column indices of all ROI pixels within a frame, as two (roi,h,w) arrays.
+    All ROIs have the same size (see Frame). Pixels outside the frame are clipped to its edge.
+
+    Parameters
+    ----------
+    rois_crop : list of Roi objects
+        ROIs within the (windowed) frame.
+    shape : tuple
+        (height,width) of the frames.
+    rows : array of int, optional
+        ROI rows to extract. The default is all rows.
+    """
+    h, w = int(rois_crop[0].h), int(rois_crop[0].w)
+    rows = np.arange(h) if rows is None else np.asarray(rows)
+    cols = np.arange(w)
+    i = np.array([int(roi.y) + rows for roi in rois_crop])[:, :, np.newaxis] + 0*cols
+    j = np.array([int(roi.x) + cols for roi in rois_crop])[:, np.newaxis, :] + 0*rows[:, np.newaxis]
+    return np.clip(i, 0, shape[0]-1), np.clip(j, 0, shape[1]-1)
+
+
+def gather_rois(data, rois_crop, layout="frame", rows=None, chunk=64, out=None):
+    """
+    Parameters
+    ----------
+    data : (N,height,width) numpy array
+        Raw frames (may be memory-mapped).
+    rois_crop : list of Roi objects
+        ROIs within the frames.
+    layout : str
+        "frame", "pixel" or "rows" (see above).
+    rows : array of int, optional
+        ROI rows to extract (e.g. the science wavelengths only). The default is all rows.
+    out : numpy array, optional
+        Output buffer of the layout's shape. The default dtype is that of the frames ("rows": float64).
+
+    Returns
+    -------
+    out : numpy array
+    """
+    if layout not in layouts:
+        raise ValueError(f"Unknown ROI layout {layout}, expected one of {layouts}")
+    n = data.shape[0]
+    i, j = roi_index(rois_crop, data.shape[1:], rows)
+    nroi, h, w = i.shape
+    if out is None:
+        if layout == "frame":
+            out = np.empty((nroi, n, h, w), dtype=data.dtype)
+        elif layout == "pixel":
+            out = np.empty((nroi, h, w, n), dtype=data.dtype)
+        else:
+            out = np.empty((nroi, h, n), dtype=np.float64)
+    for k in range(0, n, chunk):
+        # (chunk,roi,h,w)
+        block = data[k:k+chunk][:, i, j]
+        if layout == "frame":
+            out[:, k:k+chunk] = block.transpose((1, 0, 2, 3))
+        elif layout == "pixel":
+            out[..., k:k+chunk] = block.transpose((1, 2, 3, 0))
+        else:
+            out[..., k:k+chunk] = block.sum(axis=-1, dtype=np.float64).transpose((1, 2, 0))
+    return out
@@ -7,6 +7,7 @@ from PyQt5.uic import loadUi
 import sys
 import time
 import threading
+import json
 import os
 from datetime import datetime, timedelta, timezone
 import ctypes,_ctypes
@@ -19,17 +20,24 @@ from nottcontrol.camera.infratec_interface import InfratecInterface, Image
 
 import numpy
 import cv2
-from nottcontrol.camera.brightness_calculator import BrightnessCalculator
+from nottcontrol.camera.brightness_calculator import BrightnessCalculator, RoiStatsKernel
 from nottcontrol.camera.parametersdialog import ParametersDialog
-from nottcontrol.redisclient import RedisClient
+from nottcontrol.redisclient import RedisClient, RedisBatchWriter
 from nottcontrol import config
 from collections import deque
 from enum import Enum
 from nottcontrol.camera.roi import Roi
 from nottcontrol.camera.roiwidget import RoiWidget
-import queue
+from nottcontrol.camera.frame_ring import FrameRing
+from nottcontrol.camera.clock_model import ClockModel
+from nottcontrol.camera.frame_store import FrameStore
+from nottcontrol.camera.coadd import CoaddAccumulator
+from nottcontrol.camera.roi_bus import RoiBus
+from nottcontrol.camera.pipeline_stats import PipelineStats
+from nottcontrol.opcua import OPCUAConnection
 from pathlib import Path
 import zmq
+import redis
 from platform import system
 
 # Location of frames on the machine
@@ -42,10 +50,10 @@ else:
 t=time.perf_counter()
 tLive=t
 
-img_timestamp_ref = None
-
 use_camera_time = (config['CAMERA']['use_camera_time'] == "True")
 record_rois = (config['CAMERA']['record_rois'] == "True")
+clock_reference_plc = (config['CAMERA']['clock_reference_plc'] == "True")
+frame_format = config['CAMERA']['frame_format']
 
 def callback(context,*args):#, aHandle, aStreamIndex):
     # Creating timezone-aware datetime object, in utc
@@ -53,9 +61,6 @@ def callback(context,*args):#, aHandle, aStreamIndex):
     # Dropping the timezone info
     recording_timestamp = recording_timestamp.replace(tzinfo=None)
     
-    
-    global img_timestamp_ref
-    
     context.load_image(recording_timestamp,use_camera_time)
 
 class MainWindow(QMainWindow):
@@ -116,9 +121,30 @@ class MainWindow(QMainWindow):
 
         url =  config['DEFAULT']['databaseurl']
         self.redisclient = RedisClient(url)
+        # Per-stage latencies of the frame pipeline, see camera/pipeline_stats.py
+        self.pipeline_stats = PipelineStats()
+        # ROI values and integration times are written in batches, off the frame thread
+        self.redis_writer = RedisBatchWriter(self.redisclient, config['redis'].getint('batch_frames'), config['redis'].getint('batch_latency'),
+                                             self.pipeline_stats.histograms["redis"])
+        self.redis_writer.flush_listeners.append(self.on_redis_flush)
         
         self.load_roi_config(config)
 
+        fields = [f'{roi_widget.db_key}_{field}' for roi_widget in self.roi_widgets for field in ('max', 'avg', 'sum')]
+        # Labelled series can be fetched together by TS.MRANGE (see nott_database.get_fields)
+        try:
+            self.redisclient.label_series(fields + ['cam_integtime'], source='camera')
+        except redis.RedisError as e:
+            print(f"Failed to label the ROI series: {e}")
+
+        # Per-frame ROI values for local processes, see camera/roi_bus.py
+        self.roi_bus = None
+        if config['CAMERA'].getboolean('roi_bus'):
+            try:
+                self.roi_bus = RoiBus(fields + ['cam_integtime'], config['CAMERA'].getint('roi_bus_capacity'))
+            except OSError as e:
+                print(f"Failed to create the ROI bus: {e}")
+
         self.ui.actionLoad_from_config.triggered.connect(self.load_roi_positions_from_config)
         self.ui.actionSave_to_config.triggered.connect(self.save_roi_positions_to_config)
 
@@ -130,12 +156,29 @@ class MainWindow(QMainWindow):
         deque_length = 6000
 
         self.timestamps = deque(maxlen = deque_length)
-        self.coadd_frames_buffer = []
-        self.roi_queue = queue.Queue()
+        self.coadd = CoaddAccumulator()
+        # Queued frames are views on frame pool slots: the pool has to outlast the ring plus the frame being processed
+        ring_depth = config['CAMERA'].getint('frame_ring_depth')
+        pool_depth = config['CAMERA'].getint('frame_pool_depth')
+        if ring_depth + 1 >= pool_depth:
+            raise ValueError(f"frame_pool_depth ({pool_depth}) must exceed frame_ring_depth + 1 ({ring_depth + 1})")
+        self.roi_queue = FrameRing(ring_depth)
+        self.pipeline_stats.add_drop_source(lambda: self.roi_queue.overruns)
+        # Camera clock to machine (or PLC) clock reconciliation
+        self.clock = ClockModel()
+        self.opcua_conn = None
+        if clock_reference_plc:
+            try:
+                self.opcua_conn = OPCUAConnection(config['DEFAULT']['opcuaaddress'])
+                self.opcua_conn.connect()
+            except Exception as e:
+                print(f"PLC clock reference unavailable: {e}")
+                self.opcua_conn = None
         
         self.running = True
         threading.Thread(target=self.socket_server, daemon=True).start()
         self.frame_directory = frame_directory
+        self.frame_store = None
     
     def socket_server(self):
         context = zmq.Context()
@@ -159,6 +202,11 @@ class MainWindow(QMainWindow):
                     elif message == "Stop record":
                         self.stop_recording()
                         reply = "Ok"
+                    elif message == "Stats":
+                        stats = self.pipeline_stats.snapshot()
+                        stats["ring"] = self.roi_queue.stats()
+                        stats["writer"] = self.redis_writer.stats()
+                        reply = json.dumps(stats)
                     else:
                         reply = "Unknown command"
                     
@@ -173,7 +221,7 @@ class MainWindow(QMainWindow):
         self.ui.lineEdit_coadd_frames.setEnabled(self.is_coadd_enabled())
 
         if self.is_coadd_enabled:
-            self.coadd_frames_buffer.clear()
+            self.coadd.clear()
     
     def is_coadd_enabled(self):
         return self.ui.cb_coadd.isChecked()
@@ -182,57 +230,81 @@ class MainWindow(QMainWindow):
         s = self.ui.lineEdit_coadd_frames.text()
         return int(s)
 
-    def save_frame_write_redis(self, filepath, img, timestamp):
+    def save_frame_write_redis(self, filepath, img, timestamp, enqueued):
         cv2.imwrite(filepath, img)
+        self.pipeline_stats.record("record", time.perf_counter() - enqueued)
+        self.store_integtime_to_db(timestamp, self.integtime)
+
+    def store_frame_write_redis(self, img, timestamp, enqueued):
+        with self.recording_lock:
+            if self.frame_store is not None:
+                try:
+                    self.frame_store.append(img, timestamp, self.integtime)
+                except ValueError as e:
+                    print(f"Frame not recorded: {e}")
+        self.pipeline_stats.record("record", time.perf_counter() - enqueued)
         self.store_integtime_to_db(timestamp, self.integtime)
 
+    def on_redis_flush(self, samples, flushed_at):
+        # Called from the writer thread: the most recent frame of the batch is registered in the database as of now
+        stamp = max(sample[1] for sample in samples)
+        self.clock.add_write_delay(self.clock.to_datetime(stamp), flushed_at)
+
     def process_frame(self):
         tLastUpdate = time.perf_counter()
         base_path = self.frame_directory
         print(f"base directory: {base_path}")
-        while True:
-            item = self.roi_queue.get()
+        while self.running:
+            item = self.roi_queue.pop(timeout=0.5)
+            if item is None:
+                continue
             img = item[0]
 
             timestamp = item[1]
-            #base_path = r"Y:\Documents\Scify\Frames\frame_"
-            directory = Path(base_path).joinpath(timestamp.strftime("%Y%m%d"))
-            directory.mkdir(parents=True, exist_ok=True)
-            timestamp_str = timestamp.strftime("%H%M%S%f")
-            # timestamp_str_round = str(round((int(timestamp_str)/1000)))
-            timestamp_str_round = f"{round(int(timestamp_str) / 1000):09d}"
-            filename = timestamp_str_round + ".png"
-            filepath = str(Path.joinpath(directory, filename))
+            enqueued = item[3]
 
             recording = self.recording
+            thread = None
             
             if recording:
-                thread = threading.Thread(target = self.save_frame_write_redis, args =(filepath, img, timestamp))
-                thread.start()
+                if frame_format == "store":
+                    # Appending to the preallocated segment files: no thread, file or encoding per frame
+                    self.store_frame_write_redis(img, timestamp, enqueued)
+                else:
+                    #base_path = r"Y:\Documents\Scify\Frames\frame_"
+                    directory = Path(base_path).joinpath(timestamp.strftime("%Y%m%d"))
+                    directory.mkdir(parents=True, exist_ok=True)
+                    timestamp_str = timestamp.strftime("%H%M%S%f")
+                    # timestamp_str_round = str(round((int(timestamp_str)/1000)))
+                    timestamp_str_round = f"{round(int(timestamp_str) / 1000):09d}"
+                    filename = timestamp_str_round + ".png"
+                    filepath = str(Path.joinpath(directory, filename))
+                    thread = threading.Thread(target = self.save_frame_write_redis, args =(filepath, img, timestamp, enqueued))
+                    thread.start()
 
             if recording or not self.is_coadd_enabled(): #always process individual frames if recording; always process all frames if not coadding
                 self.process_roi(img, timestamp, coadded_frame=False)
+                self.pipeline_stats.record("queue", time.perf_counter() - enqueued)
                 
             #If coadding, check to see if we have the required amount of frames
             coadd_in_process = False
             if self.is_coadd_enabled():
-                self.coadd_frames_buffer.append(img)
-                if len(self.coadd_frames_buffer) >= self.nb_coadd_frames():
-                    #Create 3D array containing all values
-                    arr = numpy.array(self.coadd_frames_buffer)
-                    #maintain dtype, otherwise the background substraction will throw an error
-                    img = numpy.average(arr, axis=0).astype(numpy.uint16)
+                #Running in-place sum, the co-added frame is returned once the required amount of frames is reached
+                self.coadd.nframes = self.nb_coadd_frames()
+                coadded = self.coadd.add(img)
+                if coadded is not None:
+                    img = coadded
                     self.process_roi(img, timestamp, coadded_frame=True)
-                    self.coadd_frames_buffer.clear()
                 else:
                     coadd_in_process = True
             
             t = time.perf_counter()
             if (t-tLastUpdate) > 0.4 and not coadd_in_process:
                 tLastUpdate = t
-                self.request_image_update.emit(img)
+                # Frame pool slots are recycled, the display keeps its own copy
+                self.request_image_update.emit(img.copy())
             
-            if recording:
+            if thread is not None:
                 thread.join()
     
     def load_roi_config(self, config):
@@ -313,14 +385,37 @@ class MainWindow(QMainWindow):
         roi_frame_rate = self.roi_tracking_frames / 5
         print(f'Camera frame rate: {camera_frame_rate:.2f}')
         print(f'ROI tracking frame rate: {roi_frame_rate:.2f}')
+        self.update_clock_reference()
+        self.publish_clock()
         
         #TODO technically, need to lock
         self.nbCameraImages = 0
         self.roi_tracking_frames = 0
 
+    def update_clock_reference(self):
+        # Reference the machine clock to the PLC NTP time, read halfway a round trip to the PLC
+        if self.opcua_conn is None:
+            return
+        try:
+            t_before = datetime.now(timezone.utc).replace(tzinfo=None)
+            timestamp = self.opcua_conn.read_node("ns=4;s=INFRATEC_TRIGERS.sNTPExtTime")
+            t_after = datetime.now(timezone.utc).replace(tzinfo=None)
+            timestamp_plc = datetime.strptime(timestamp, '%Y-%m-%d-%H:%M:%S.%f')
+            self.clock.add_reference(t_before + (t_after - t_before) / 2, timestamp_plc)
+        except Exception as e:
+            print(f"Failed to read PLC time: {e}")
+
+    def publish_clock(self):
+        # Share the current clock model, so that other processes get the camera delay without probing the database
+        if not self.connected or self.clock.frames == 0:
+            return
+        try:
+            self.redisclient.set_cam_clock(datetime.now(timezone.utc).replace(tzinfo=None), self.clock.state())
+        except Exception as e:
+            print(f"Failed to publish camera clock: {e}")
+
     def connect_clicked(self):
         if not self.connected:
-            self.time_reference_frames = 0
             self.connect_camera()
             self.integtime = self.interface.getparam_idx_int32(262,0)
         else:
@@ -330,8 +425,7 @@ class MainWindow(QMainWindow):
         if self.connected:
             return
         
-        global img_timestamp_ref
-        img_timestamp_ref = None
+        self.clock.reset()
         if(self.interface.connect(callback, self)):
             self.connected = True
             self.ui.button_connect.setText('Disconnect')
@@ -384,7 +478,6 @@ class MainWindow(QMainWindow):
         if self.recording:
             self.stop_recording()
         else:
-            self.time_reference_frames = 0
             self.start_recording()
             
     def start_recording(self):
@@ -396,6 +489,10 @@ class MainWindow(QMainWindow):
         # Store current camera integration time
         self.integtime = self.interface.getparam_idx_int32(262,0)
         
+        if frame_format == "store":
+            with self.recording_lock:
+                self.frame_store = FrameStore(self.frame_directory, config['CAMERA'].getint('segment_size_mb'))
+        
         self.timestamps.clear()
         for roi_widget in self.roi_widgets:
             roi_widget.clear_max_values()
@@ -412,6 +509,11 @@ class MainWindow(QMainWindow):
         self.ui.button_record.setText('Start')
         self.ui.label_recording.setText('Not recording')
         self.recording = False
+        
+        with self.recording_lock:
+            if self.frame_store is not None:
+                self.frame_store.close()
+                self.frame_store = None
 
     def trigger_clicked(self):
         print('trigger')
@@ -423,7 +525,6 @@ class MainWindow(QMainWindow):
     def load_image(self, recording_timestamp, use_camera_time):  
         global t
         global tLive
-        global img_timestamp_ref
         now=time.perf_counter()
         # print(now-t)
         t = now
@@ -435,35 +536,20 @@ class MainWindow(QMainWindow):
         with self.interface.get_image() as image:
             img = image.get_image_data()
             if not self.imageInit:
-                self.request_image_update.emit(img)
-            timestamp_offset = image.get_timestamp() #not used ATM, but can we use this as a failsafe somehow?
-                
-        if self.time_reference_frames < 100:
-            new_timestamp_ref = recording_timestamp - timedelta(milliseconds=timestamp_offset)
-            print(f"Timestamp reference: {new_timestamp_ref}")
-            if img_timestamp_ref is None:
-                img_timestamp_ref = new_timestamp_ref
-            #Take the earliest time because there is always a delay, and the estimated timestamp can never be earlier thatn the actual timestamp
-            img_timestamp_ref = min(img_timestamp_ref, new_timestamp_ref)
-
-            self.time_reference_frames = self.time_reference_frames + 1
-
-            if self.time_reference_frames == 100:
-                print(f"Final timestamp reference: {img_timestamp_ref}")
-
-            #Use the first 100 frames purely to establish time
-            return
+                # Frame pool slots are recycled, the display keeps its own copy
+                self.request_image_update.emit(img.copy())
+            timestamp_offset = image.get_timestamp()
         
         if use_camera_time:
             timestamp = timedelta(milliseconds=timestamp_offset)
         else:
-            timestamp = img_timestamp_ref + timedelta(milliseconds=timestamp_offset)
+            # Stamping by the continuously fitted camera clock model (offset & drift), from the very first frame onwards
+            timestamp = self.clock.update(timestamp_offset, recording_timestamp)
         #print(f"Delay: {recording_timestamp - timestamp}")
         
-        if(self.roi_queue.qsize() > 5):
-            print('Dropping frame!')
-        else:
-            self.roi_queue.put((img, timestamp))
+        # Frames that do not fit are dropped and counted by the ring
+        self.roi_queue.push(img, timestamp)
+        self.pipeline_stats.record("callback", time.perf_counter() - now)
 
     
     def initialize_image_display(self, img):
@@ -517,6 +603,8 @@ class MainWindow(QMainWindow):
                 
     def process_roi(self, img, timestamp, coadded_frame):
         calculator = self.run_roi_calculator(img)
+        if not coadded_frame and self.roi_bus is not None:
+            self.publish_roi_to_bus(timestamp, calculator)
         if not coadded_frame and self.recording:
             if record_rois:
                 self.store_roi_to_db(timestamp, calculator)
@@ -533,10 +621,18 @@ class MainWindow(QMainWindow):
         self.roi_calculation_finished.emit(calculator)
 
     def run_roi_calculator(self, img):
-        calculator = BrightnessCalculator([roi_widget.roi.getArrayRegion(img, self.image.getImageItem()) for roi_widget in self.roi_widgets])
-        calculator.run()
+        calculator = BrightnessCalculator.from_kernel(self.get_roi_kernel(img.shape), img)
         return calculator
 
+    def get_roi_kernel(self, shape):
+        # The packed ROI table is only rebuilt when a ROI is moved/resized or the frame size changes
+        rois = [Roi(*roi_widget.roi.pos(), *roi_widget.roi.size()) for roi_widget in self.roi_widgets]
+        key = (tuple(shape), tuple((roi.x, roi.y, roi.w, roi.h) for roi in rois))
+        if getattr(self, 'roi_kernel_key', None) != key:
+            self.roi_kernel = RoiStatsKernel(rois, shape)
+            self.roi_kernel_key = key
+        return self.roi_kernel
+
     def store_roi_to_db(self, timestamp, calculator):
         roi_values = dict()
         for i in range(len(self.roi_widgets)):
@@ -544,13 +640,18 @@ class MainWindow(QMainWindow):
             value = calculator.results[i]
             roi_values[key] = value
         
-        self.redisclient.add_roi_values(timestamp, roi_values)
+        self.redis_writer.add_roi_values(timestamp, roi_values)
         
+    def publish_roi_to_bus(self, timestamp, calculator):
+        values = [value for result in calculator.results for value in (result.max, result.avg, result.sum)]
+        values.append(self.integtime)
+        self.roi_bus.publish(self.redisclient.unix_time_ms(timestamp), values)
+
     def store_framerate_to_db(self, timestamp, framerate):
         self.redisclient.add_cam_framerate(timestamp,framerate)
         
     def store_integtime_to_db(self, timestamp, integtime):
-        self.redisclient.add_cam_integtime(timestamp,integtime)
+        self.redis_writer.add_cam_integtime(timestamp,integtime)
         
     def on_roi_calculations_finished(self, calculator):
         for i in range(len(self.roi_widgets)):
@@ -566,6 +667,7 @@ class MainWindow(QMainWindow):
         super().closeEvent(*args)
 
         self.running = False
+        self.redis_writer.close()
 
 if __name__ == "__main__":
     app = QApplication(sys.argv)
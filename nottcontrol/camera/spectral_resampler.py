@@ -0,0 +1,130 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Sat Oct 17 09:12:44 2026
+
+Spectral rectification of the dispersed outputs: resampling of the ROI rows of every output onto one common wavelength grid.
+
+Each ROI has its own wavelength solution (wavelength of each ROI row, linear or not). From these, a sparse resampling
+matrix is computed once per ROI; the matrices are assembled block-diagonally, so that a whole sequence of spectra
+(e.g. Frame.calib_seq_nifits_format, (N,h,roi)) is rectified by a single sparse matrix product, with the errors
+propagated through the squared weights.
+Two schemes are available:
+    "interp" : linear interpolation between the two ROI rows around each grid wavelength
+    "rebin"  : flux-conserving rebinning, by the overlap of the ROI rows with the grid bins (edges halfway between wavelengths)
+Grid wavelengths outside the wavelength range of a ROI are NaN.
+
+"""
+
+import numpy as np
+from scipy import sparse
+
+
+def _edges(lambs):
+    # Bin edges halfway between (ascending) wavelengths, extrapolated at both ends
+    mid = 0.5 * (lambs[1:] + lambs[:-1])
+    return np.concatenate(([lambs[0] - (mid[0]-lambs[0])], mid, [lambs[-1] + (lambs[-1]-mid[-1])]))
+
+
+def resampling_matrix(lambs, grid, mode="interp"):
+    """
+    Parameters
+    ----------
+    lambs : (h,) numpy array
+        Wavelength of each ROI row (monotonic, increasing or decreasing).
+    grid : (ngrid,) numpy array
+        Increasing output wavelengths.
+    mode : str
+        "interp" or "rebin".
+
+    Returns
+    -------
+    (matrix, covered) : (ngrid,h) sparse CSR matrix and the (ngrid,) mask of grid wavelengths within the ROI's range.
+    """
+    order = np.argsort(lambs)
+    lsort = np.asarray(lambs)[order]
+    h, ngrid = len(lsort), len(grid)
+    weights = np.zeros((ngrid, h))
+    if mode == "interp":
+        covered = (grid >= lsort[0]) & (grid <= lsort[-1])
+        j = np.clip(np.searchsorted(lsort, grid) - 1, 0, h-2)
+        t = np.clip((grid - lsort[j]) / (lsort[j+1] - lsort[j]), 0., 1.)
+        rows = np.arange(ngrid)
+        weights[rows, order[j]] = 1. - t
+        weights[rows, order[j+1]] += t
+    elif mode == "rebin":
+        e_in, e_out = _edges(lsort), _edges(np.asarray(grid, dtype=float))
+        covered = (e_out[:-1] >= e_in[0]) & (e_out[1:] <= e_in[-1])
+        # Overlap of output bin k with input row i, as a fraction of the input row width
+        overlap = np.clip(np.minimum(e_out[1:, None], e_in[None, 1:]) - np.maximum(e_out[:-1, None], e_in[None, :-1]), 0., None)
+        weights[:, order] = overlap / np.diff(e_in)[None]
+    else:
+        raise ValueError(f"Unknown resampling mode {mode}, expected interp or rebin")
+    weights[~covered] = 0.
+    return sparse.csr_matrix(weights), covered
+
+
+class SpectralResampler(object):
+
+    def __init__(self, lambs, grid, mode="interp"):
+        """
+        Parameters
+        ----------
+        lambs : (roi,h) or (h,) numpy array
+            Wavelength solution of each ROI (a (h,) array is shared by all ROIs).
+        grid : (ngrid,) numpy array
+            Common output wavelengths, same unit as lambs.
+        mode : str
+            "interp" or "rebin" (see above).
+        """
+        self.grid = np.asarray(grid, dtype=float)
+        self.lambs = np.atleast_2d(lambs)
+        self.mode = mode
+        self.nroi, self.h = self.lambs.shape
+        blocks, covered = zip(*[resampling_matrix(roi_lambs, self.grid, mode) for roi_lambs in self.lambs])
+        self.matrix = sparse.block_diag(blocks, format="csr")
+        self.matrix_sq = self.matrix.multiply(self.matrix).tocsr()
+        # (ngrid,roi) grid wavelengths outside the range of the ROI
+        self.uncovered = ~np.array(covered).T
+
+    def _apply(self, matrix, values):
+        # (N,h,roi) -> (N,ngrid,roi) by one sparse product over all ROIs and spectra
+        n, h, nroi = values.shape
+        if self.nroi == 1:
+            # Shared wavelength solution: all ROIs are columns of the same product
+            cols = np.ascontiguousarray(values.transpose((1, 0, 2))).reshape((h, -1))
+            out = (matrix @ cols).reshape((len(self.grid), n, nroi)).transpose((1, 0, 2))
+        else:
+            cols = np.ascontiguousarray(values.transpose((2, 1, 0))).reshape((-1, n))
+            out = (matrix @ cols).reshape((nroi, len(self.grid), n)).transpose((2, 1, 0))
+        out[:, np.broadcast_to(self.uncovered, out.shape[1:])] = np.nan
+        return out
+
+    def apply(self, values, std=None):
+        """
+        Rectify spectra of all ROIs.
+
+        Parameters
+        ----------
+        values : (h,roi) or (N,h,roi) numpy array
+            Spectra (ROI rows summed over the ROI width), e.g. from Frame.calib_master_nifits_format or Frame.calib_seq_nifits_format.
+            NaN rows (e.g. outside a row mask) only affect the grid wavelengths they contribute to.
+        std : numpy array, optional
+            Errors on the spectra, same shape as values (or (h,roi) for a sequence). Propagated assuming independent rows.
+
+        Returns
+        -------
+        values : (ngrid,roi) or (N,ngrid,roi) numpy array
+        std : idem, if std is given
+        """
+        single = values.ndim == 2
+        values = values[np.newaxis] if single else values
+        out = self._apply(self.matrix, values)
+        if single:
+            out = out[0]
+        if std is None:
+            return out
+        std_single = std.ndim == 2
+        out_std = np.sqrt(self._apply(self.matrix_sq, np.square(std[np.newaxis] if std_single else std)))
+        if std_single:
+            out_std = out_std[0]
+        return out, out_std
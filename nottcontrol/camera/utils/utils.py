@@ -1,6 +1,7 @@
 class BrightnessResults():
-    def __init__(self, min, max, avg, sum):
+    def __init__(self, min, max, avg, sum, sumsq=None):
         self.min = min
         self.max = max
         self.avg = avg
-        self.sum = sum
\ No newline at end of file
+        self.sum = sum
+        self.sumsq = sumsq
\ No newline at end of file
@@ -0,0 +1,77 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Fri Oct 16 18:02:51 2026
+
+This class accumulates the per-pixel mean and standard deviation of a stream of frames, in a single pass.
+
+The running mean and sum of squared deviations (M2) are updated per frame (Welford) or per chunk of frames
+(Chan et al. pairwise merge), so memory use is that of a few frames, whatever the amount of accumulated frames,
+and (master, std/sqrt(N)) is available at any moment.
+
+"""
+
+import numpy as np
+
+
+class WelfordAccumulator(object):
+
+    def __init__(self, shape=None):
+        """
+        Parameters
+        ----------
+        shape : tuple, optional
+            Shape of one frame. If None, set by the first added frame.
+        """
+        self.count = 0
+        self.mean = None
+        self.m2 = None
+        if shape is not None:
+            self._allocate(shape)
+
+    def _allocate(self, shape):
+        self.mean = np.zeros(shape, dtype=np.float64)
+        self.m2 = np.zeros(shape, dtype=np.float64)
+
+    def add(self, frame):
+        # Add one frame (Welford update)
+        if self.mean is None:
+            self._allocate(frame.shape)
+        self.count += 1
+        delta = frame - self.mean
+        self.mean += delta / self.count
+        self.m2 += delta * (frame - self.mean)
+
+    def add_batch(self, frames, axis=0, chunk=64):
+        """
+        Add a stack of frames, "chunk" frames at a time along "axis" (float64 temporaries never exceed one chunk).
+        """
+        n = frames.shape[axis]
+        for k in range(0, n, chunk):
+            block = frames[(slice(None),)*axis + (slice(k, k+chunk),)]
+            block_mean = block.mean(axis=axis, dtype=np.float64)
+            block_m2 = np.square(block - np.expand_dims(block_mean, axis)).sum(axis=axis)
+            self.merge(block.shape[axis], block_mean, block_m2)
+
+    def merge(self, count, mean, m2):
+        # Merge the statistics of another set of "count" frames (Chan et al.)
+        if count == 0:
+            return
+        if self.mean is None:
+            self._allocate(mean.shape)
+        total = self.count + count
+        delta = mean - self.mean
+        self.mean += delta * (count / total)
+        self.m2 += m2 + np.square(delta) * (self.count * count / total)
+        self.count = total
+
+    def std(self):
+        # Per-pixel (population) standard deviation of the accumulated frames, as np.std
+        return np.sqrt(self.m2 / max(self.count, 1))
+
+    def result(self):
+        """
+        Returns
+        -------
+        (master, master_std) : the mean frame and the std on that mean (std/sqrt(N)).
+        """
+        return self.mean.copy(), self.std() / np.sqrt(max(self.count, 1))
@@ -19,8 +19,11 @@ mean_wl = np.sum(x_filter*y_filter) / np.sum(y_filter)
 
 from nottcontrol.opcua import OPCUAConnection
 from nottcontrol.components.shutter import Shutter
-from nottcontrol.camera.frame import Frame
-from nottcontrol.script.lib.nott_database import get_field
+from nottcontrol.camera.frame import Frame, MasterFrame, frame_directory, bad_pixels
+from nottcontrol.camera.dark_library import DarkLibrary, roi_values
+from nottcontrol.camera.spectral_resampler import SpectralResampler
+from pathlib import Path
+from nottcontrol.script.lib.nott_database import get_field, get_fields
 from configparser import ConfigParser
 from nottcontrol import config 
 
@@ -107,6 +110,8 @@ class HumInt(object):
         self.rois = rois_interest
         self.dark = None
         self.bg_noise = None
+        self.dark_library = DarkLibrary(Path(frame_directory).joinpath("darks"), config['CAMERA'].getfloat('dark_max_age'),
+                                        temp_bucket=config['CAMERA'].getfloat('dark_temp_bucket'))
         self.opcua_conn = OPCUAConnection(opcuad)
         self.opcua_conn.connect()
         self.shutters = [
@@ -179,6 +184,44 @@ class HumInt(object):
         self.lambs = 1.0e-6 * calibration
         self.sc_mask = np.logical_and(self.lambs >= 1.0e-6 * lamb_low,
                                             self.lambs <= 1.0e-6 * lamb_high)
+        # Same solution for all ROIs
+        self.lambs_rois = np.tile(self.lambs, (len(Frame.rois_cfg), 1))
+        self.set_resampler()
+
+    def solve_spectral_cal_poly(self):
+        """
+            Per-ROI, possibly nonlinear, spectral calibration: writes to
+        `self.lambs_rois` the wavelength value [m] of each row of each roi,
+        from the polynomials `lamb_poly roi <k>` (micron vs. roi row,
+        coefficients as for np.polyval) in the config file. ROIs without
+        a polynomial keep the linear solution of `solve_spectral_cal_linear`,
+        which also defines `self.lambs` and the science mask.
+            The resampler onto the common (science) wavelength grid is
+        rebuilt accordingly.
+        """
+        self.solve_spectral_cal_linear()
+        rows = np.arange(self.lambs_rois.shape[1])
+        for k in range(len(self.lambs_rois)):
+            key = f"lamb_poly roi {k+1}"
+            if config.config_parser.has_option("CAMERA", key):
+                self.lambs_rois[k] = 1.0e-6 * np.polyval(config.getarray("CAMERA", key), rows)
+        self.set_resampler()
+
+    def set_resampler(self, grid=None):
+        """
+            Precomputes the resampling of all ROIs onto the common wavelength
+        grid [m] (default: the science wavelengths `self.sc_lambs`).
+        """
+        if grid is None:
+            grid = self.sc_lambs
+        self.resampler = SpectralResampler(self.lambs_rois, grid, config["CAMERA"]["spectral_resampling"])
+
+    def rectify(self, values, std=None):
+        """
+            Resamples (h,roi) or (N,h,roi) spectra of all ROIs onto the common
+        wavelength grid `self.resampler.grid` (see camera/spectral_resampler.py).
+        """
+        return self.resampler.apply(values, std)
 
     @property
     def sc_lambs(self):
@@ -191,6 +234,18 @@ class HumInt(object):
         aresp = self.ts.ts.get(f"cam_integtime")
         return aresp[0]
 
+    def db_integtime(self):
+        # Current camera integration time (us)
+        aresp = self.ts.ts.get(f"cam_integtime")
+        return aresp[1]
+
+    def cryo_temperature(self):
+        try:
+            return float(self.opcua_conn.read_node(config['CAMERA']['dark_temperature_node']))
+        except Exception as e:
+            print(f"Failed to read the cryostat temperature: {e}")
+            return None
+
     def four2three(self, position):
         return position - position[self.non_motorized]
 
@@ -283,21 +338,25 @@ class HumInt(object):
     def sample_cal(self):
         return self.sample() - self.dark
 
+    def roi_fields(self):
+        # Database fields of the ROIs of interest: field names as given, ROI numbers as their roi<n>_sum field
+        return [akey if isinstance(akey, str) else f"roi{akey}_sum" for akey in self.rois]
+
     def sample_long(self, dt=1.0):
         # start = int(np.round(time()*1000).astype(int))
         start = self.db_time()
         sleep(dt)
         # end = int(np.round(time()*1000).astype(int))
         end = self.db_time()
-        mes = np.array([self.ts.ts.range(akey, start, end) for akey in self.rois])
-        return mes.T[1]
+        # All ROIs in one query, aligned on the frame timestamps (from the ROI bus if a live camera process on this
+        # machine publishes the whole range, see nott_database.get_fields)
+        return get_fields(self.roi_fields(), start, end)[1].T
 
     def sample_long_cal(self, dt):
         return self.sample_long(dt=dt) - self.dark
 
-    def move_and_sample(self, position, dt=None, move_back=True, dark=None):
-        if dark is None:
-            dark = self.dark
+    def move_and_sample(self, position, dt=None, move_back=True, dark=None, row_mask=None):
+        # dark : master dark, by default the matching library dark (see get_frames_cal)
         orig_pos = self.get_position()
         self.move(position)
         sleep(self.pad)
@@ -306,7 +365,7 @@ class HumInt(object):
             # res = self.sample_cal()
         else:
             # res = self.sample_long_cal(dt)
-            res, std = self.get_frames_cal(dt=dt, dark=dark, sequence=False)
+            res, std = self.get_frames_cal(dt=dt, dark=dark, sequence=False, row_mask=row_mask)
         if move_back:
             print(f"moving_back to {orig_pos}")
             self.move(orig_pos)
@@ -329,6 +388,10 @@ class HumInt(object):
         start = self.db_time()
         sleep(dt)
         end = self.db_time()
+        # Frames recorded in the segment store are read by time range directly, as one memory-mapped cube
+        frames = Frame.from_range(start, end)
+        if frames is not None:
+            return frames
         # Fetching (timestamp,integration time) pairs, for each camera frame captured in this timeframe dt, from redis.
         pairs = get_field("cam_integtime", start, end, False)
         # Fetching InfraTec timestamps registered in this timeframe        
@@ -345,13 +408,24 @@ class HumInt(object):
         
         return frames
 
-    def frame_sequence(self, dt, shutter_state=None, verbose=False):
+    def get_master(self, dt):
+        # Master frame of the frames taken in the coming dt seconds, accumulated while they are recorded (see MasterFrame).
+        # Falls back to the full sequence of frames if they are not recorded in the segment store.
+        start = self.db_time()
+        master = MasterFrame.from_stream(start, start + round(dt*1000))
+        if master is not None:
+            return master
+        return self.get_frames(dt)
+
+    def frame_sequence(self, dt, shutter_state=None, verbose=False, master=False):
         """
         Identical to get_frames but adding shutter control.
         Brings the shutters to given shutter_state (if not None), takes frames in that state, brings shutters back to initial state.
+        If master, only the master frame is accumulated (see get_master).
         """
+        take = self.get_master if master else self.get_frames
         if shutter_state is None:
-            frames = self.get_frames(dt)
+            frames = take(dt)
             return frames
         else:
             # Current shutter state
@@ -359,25 +433,36 @@ class HumInt(object):
             # Bring shutters to input state
             self.shutter_set(shutter_state, wait=True, verbose=verbose)
             # Take sequence
-            frames = self.get_frames(dt)
+            frames = take(dt)
             # Bring shutters back
             self.shutter_set(shutter_state_pre, wait=True, verbose=verbose)
             return frames
     
-    def get_frames_cal(self, dt, dark=None, sequence=False):
-        if dark is None:
-            if verbose:
-                print("Using the default dark")
-            dark = self.dark
+    def get_frames_cal(self, dt, dark=None, sequence=False, row_mask=None, rectify=False, rate=False):
+        # dark : master dark, by default the matching library dark (see library_dark)
+        # row_mask : only calibrate these wavelength rows (e.g. self.sc_mask), others are NaN
+        # rectify : resample the spectra of all ROIs onto the common wavelength grid (see set_resampler)
+        # rate : calibrate per integration time, in counts/s, with a library dark per integration time (see Frame.calib_rate)
+        if dark is None and not rate:
+            dark = self.library_dark(dt)
         frames = self.get_frames(dt)
+        if rate:
+            cal, cal_std = frames.calib_rate(self.dit_darks(dt), master=not sequence, nifits=True, row_mask=row_mask)
+            if rectify:
+                return self.rectify(cal, cal_std)
+            return cal, cal_std
         if not sequence:
-            cal_mean, cal_mean_std = frames.calib_master_nifits_format(dark)
+            cal_mean, cal_mean_std = frames.calib_master_nifits_format(dark, row_mask=row_mask)
             if self.auto_display is not False:
                 self.buffer_broad.push(cal_mean[self.sc_mask,:].sum(axis=0))
                 self.buffer_disp.push(cal_mean[self.sc_mask,:].T.flatten())
+            if rectify:
+                return self.rectify(cal_mean, cal_mean_std)
             return cal_mean, cal_mean_std
         else:
-            cal_seq, cal_seq_std = frames.calib_seq_nifits_format(dark)
+            cal_seq, cal_seq_std = frames.calib_seq_nifits_format(dark, row_mask=row_mask)
+            if rectify:
+                return self.rectify(cal_seq, cal_seq_std)
             return cal_seq, cal_seq_std
 
     def get_frames_cal_to_np(self, dt, dark=None, sequence=False):
@@ -389,14 +474,62 @@ class HumInt(object):
     def science_frame_sequence(self, dt, verbose=False):
         return self.frame_sequence(dt, shutter_state=[1,1,1,1], verbose=verbose)
     
-    def dark_frame_sequence(self, dt, verbose=False):
-        return self.frame_sequence(dt, shutter_state=[0,0,0,0], verbose=verbose)
+    def dark_frame_sequence(self, dt, verbose=False, master=False):
+        return self.frame_sequence(dt, shutter_state=[0,0,0,0], verbose=verbose, master=master)
 
-    def dark_sequence(self, dt=0.5, verbose=False):
-        self.shutter_set(np.array([0,0,0,0]), wait=True, verbose=verbose)
-        mydark = self.get_dark(dt=dt)
-        self.shutter_set(np.array([1,1,1,1]), wait=True, verbose=verbose)
-        return mydark
+    def library_dark(self, dt, max_age=None, verbose=False, fresh=False):
+        """
+        Master dark matching the current integration time, window, ROIs and cryostat temperature, from the dark library.
+        Only if there is none, or if fresh, the shutters are closed and a new dark of dt seconds is taken and stored in the library.
+        """
+        temperature = self.cryo_temperature()
+        dark = None
+        if not fresh:
+            dark = self.dark_library.lookup(self.db_integtime(), temperature=temperature, max_age=max_age)
+        if dark is not None:
+            if verbose:
+                print(f"Using library dark {dark.ids[0]} - {dark.ids[-1]}")
+            return dark
+        dark = self.dark_frame_sequence(dt, verbose=verbose, master=True)
+        self.dark_library.store(dark, temperature)
+        # Every new dark refines the bad pixel mask
+        bad_pixels.learn(*dark.master_full, dark.window)
+        bad_pixels.save()
+        return dark
+
+    def dit_darks(self, dt, max_age=None, verbose=False):
+        """
+        Function returning the library dark matching a given integration time (us), for calibration of mixed-DIT
+        sequences (see Frame.calib_rate). A missing dark is only taken (dt seconds) for the current integration time.
+        """
+        temperature = self.cryo_temperature()
+        darks = {}
+
+        def get_dark(dit):
+            if dit not in darks:
+                dark = self.dark_library.lookup(dit, temperature=temperature, max_age=max_age)
+                if dark is None and abs(dit - self.db_integtime()) <= 1:
+                    dark = self.library_dark(dt, max_age=max_age, verbose=verbose)
+                if dark is None:
+                    raise Exception(f"No dark for integration time {dit} us in the dark library, take one at that integration time first.")
+                darks[dit] = dark
+            return darks[dit]
+
+        return get_dark
+
+    def dark_sequence(self, dt=0.5, verbose=False, fresh=False):
+        # Dark of the ROI values (self.dark, self.bg_noise, see sample_long_cal), from the matching library dark.
+        # The shutters are only closed to take a new dark if the library has none, or if fresh.
+        dark = self.library_dark(dt, verbose=verbose, fresh=fresh)
+        values = roi_values(dark, self.rois)
+        if values is None and not fresh:
+            # Library dark stored without the per-frame ROI values: take a new one
+            dark = self.library_dark(dt, verbose=verbose, fresh=True)
+            values = roi_values(dark, self.rois)
+        if values is None:
+            raise Exception("Per-frame ROI values of the dark unavailable in the database.")
+        self.dark, self.bg_noise = values
+        return dark
 
     def identify_outputs(self,data,rois_crop,rois_data,use_geom=True,snr_thresh=5):
         # 'data' : numpy array containing the calibrated image data of the full master frame
@@ -643,7 +776,8 @@ class HumInt(object):
             pistons = []
             print("Scan of baseline: ",amode)
             for apos in mysequence:
-                a, a_std = self.move_and_sample(apos, dt=dt, move_back=False)
+                # Only the science wavelengths are kept
+                a, a_std = self.move_and_sample(apos, dt=dt, move_back=False, row_mask=self.sc_mask)
                 fringes.append(a)
                 fringes_std.append(a_std)
                 if dt is not None:
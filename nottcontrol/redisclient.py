@@ -2,6 +2,9 @@ import redis
 from datetime import datetime
 from nottcontrol.camera.utils.utils import BrightnessResults
 import json
+import threading
+import time
+from collections import deque
 
 class RedisClient:
     def __init__(self, url):
@@ -46,16 +49,47 @@ class RedisClient:
 
         pipe = self.ts.pipeline()
 
+        for key, field, value in self.roi_samples(roi_results):
+            pipe.add(f'{key}_{field}', unix_time, value)
+
+        pipe.execute()
+
+    @staticmethod
+    def roi_samples(roi_results: dict[str, BrightnessResults]):
+        # (roi key, field, value) triplets written for each ROI
+        samples = []
         for key in roi_results.keys():
             brightness_result = roi_results[key]
-            pipe.add(f'{key}_max', unix_time, brightness_result.max)
-            pipe.add(f'{key}_avg', unix_time, brightness_result.avg)
-            pipe.add(f'{key}_sum', unix_time, brightness_result.sum)
+            samples.append((key, 'max', brightness_result.max))
+            samples.append((key, 'avg', brightness_result.avg))
+            samples.append((key, 'sum', brightness_result.sum))
+        return samples
 
+    def label_series(self, keys, **labels):
+        # Label time series by their name (and the given labels), creating them if needed, so that they can be
+        # selected together by TS.MRANGE filters (e.g. "name=(roi1_avg,roi2_avg)")
+        pipe = self.db.pipeline(transaction=False)
+        for key in keys:
+            key_labels = [item for label in dict(labels, name=key).items() for item in label]
+            if self.db.exists(key):
+                pipe.execute_command("TS.ALTER", key, "LABELS", *key_labels)
+            else:
+                pipe.execute_command("TS.CREATE", key, "LABELS", *key_labels)
         pipe.execute()
+
     def unix_time_ms(self, time):
         return round((time - self.epoch).total_seconds() * 1000.0)
     
+    def set_cam_clock(self, time, clock_state):
+        clock_state = dict(clock_state, updated=self.unix_time_ms(time))
+        self.db.json().set("cam_clock", "$", clock_state)
+
+    def get_cam_clock(self):
+        cam_clock = self.db.json().get("cam_clock", "$")
+        if cam_clock is None:
+            return None
+        return cam_clock[0]
+
     def save_DL_pos(self, dl_pos_json):
         self.db.json().set("saved_pos", "$", dl_pos_json)
     
@@ -64,4 +98,142 @@ class RedisClient:
         if saved_pos is None:
             return {}
         else:
-            return saved_pos[0]
\ No newline at end of file
+            return saved_pos[0]
+
+
+class RedisBatchWriter:
+    # Buffers per-frame ROI values and integration times, and writes them to the database from a background thread,
+    # as TS.MADD batches. A batch is flushed once "max_frames" per-frame entries are buffered, or once the oldest entry
+    # is "max_latency" ms old, whichever comes first. The frame thread itself never waits on the database.
+
+    def __init__(self, redisclient: RedisClient, max_frames=50, max_latency=20, histogram=None):
+        self.redisclient = redisclient
+        # Optional latency histogram (camera/pipeline_stats.py), recording the time from enqueueing to flushing of each entry
+        self.histogram = histogram
+        self.max_frames = max_frames
+        self.max_latency = max_latency * 1e-3
+        # Entries : (enqueue time, [(key, unix ms, value), ...]), one per frame
+        self._queue = deque()
+        self._wakeup = threading.Event()
+        self._running = True
+        # Called as listener(samples, flushed_at) after every successful flush
+        self.flush_listeners = []
+        self.flushes = 0
+        self.samples_written = 0
+        self.errors = 0
+        # Samples rejected by the database within otherwise successful flushes (e.g. missing key, duplicate timestamp)
+        self.failed_samples = 0
+        self.last_flush_latency = 0.
+        self.max_flush_latency = 0.
+        self.max_queue_depth = 0
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def add_roi_values(self, time, roi_results: dict[str, BrightnessResults]):
+        unix_time = self.redisclient.unix_time_ms(time)
+        self._enqueue([(f'{key}_{field}', unix_time, value) for key, field, value in RedisClient.roi_samples(roi_results)])
+
+    def add_cam_integtime(self, time, integtime):
+        unix_time = self.redisclient.unix_time_ms(time)
+        self._enqueue([('cam_integtime', unix_time, integtime)])
+
+    def _enqueue(self, samples):
+        self._queue.append((time.perf_counter(), samples))
+        depth = len(self._queue)
+        if depth > self.max_queue_depth:
+            self.max_queue_depth = depth
+        if depth >= self.max_frames:
+            self._wakeup.set()
+
+    def _run(self):
+        while self._running or len(self._queue) > 0:
+            # The writer thread must outlive any failure, or the queue would grow without ever being written again
+            try:
+                if len(self._queue) == 0:
+                    self._wakeup.wait(self.max_latency)
+                else:
+                    age = time.perf_counter() - self._queue[0][0]
+                    if len(self._queue) < self.max_frames and age < self.max_latency and self._running:
+                        self._wakeup.wait(self.max_latency - age)
+                self._wakeup.clear()
+                if len(self._queue) >= self.max_frames or (len(self._queue) > 0 and
+                        (time.perf_counter() - self._queue[0][0] >= self.max_latency or not self._running)):
+                    self.flush()
+            except Exception as e:
+                self.errors += 1
+                print(f"Redis batch writer error: {e}")
+
+    def flush(self):
+        samples = []
+        enqueued = []
+        while len(self._queue) > 0:
+            entry = self._queue.popleft()
+            enqueued.append(entry[0])
+            samples.extend(entry[1])
+        if len(samples) == 0:
+            return
+        t0 = time.perf_counter()
+        try:
+            reply = self.redisclient.ts.madd(samples)
+        except Exception as e:
+            self.errors += 1
+            print(f"Failed to write {len(samples)} samples to redis: {e}")
+            return
+        # TS.MADD reports failures per sample, in its reply, instead of raising
+        failed = [k for k, result in enumerate(reply) if isinstance(result, Exception)]
+        missing = [k for k in failed if "does not exist" in str(reply[k])]
+        if len(missing) > 0:
+            # Unlike TS.ADD, TS.MADD does not create missing series (e.g. if label_series failed at startup): add these
+            # samples one by one, which creates the series (labelled by name, as label_series would)
+            added = self._add_missing([samples[k] for k in missing])
+            failed = [k for k in failed if k not in missing] + [k for k, result in zip(missing, added) if isinstance(result, Exception)]
+            failed.sort()
+        if len(failed) > 0:
+            self.errors += 1
+            self.failed_samples += len(failed)
+            print(f"Failed to write {len(failed)} of {len(samples)} samples to redis: {reply[failed[0]]} ({samples[failed[0]][0]})")
+            failed = set(failed)
+            samples = [sample for k, sample in enumerate(samples) if k not in failed]
+        self.last_flush_latency = (time.perf_counter() - t0) * 1e3
+        self.max_flush_latency = max(self.max_flush_latency, self.last_flush_latency)
+        self.flushes += 1
+        self.samples_written += len(samples)
+        if self.histogram is not None:
+            t1 = time.perf_counter()
+            for t_entry in enqueued:
+                self.histogram.record(t1 - t_entry)
+        if len(samples) == 0:
+            return
+        flushed_at = datetime.utcnow()
+        for listener in self.flush_listeners:
+            try:
+                listener(samples, flushed_at)
+            except Exception as e:
+                print(f"Redis flush listener error: {e}")
+
+    def _add_missing(self, samples):
+        # TS.ADD of (key, unix ms, value) samples, creating their series. Returns the per-sample results.
+        pipe = self.redisclient.ts.pipeline()
+        for key, timestamp, value in samples:
+            pipe.add(key, timestamp, value, labels={"name": key})
+        try:
+            return pipe.execute(raise_on_error=False)
+        except Exception as e:
+            return [e] * len(samples)
+
+    def stats(self):
+        # Snapshot of the writer state (latencies in ms)
+        return {"queue_depth": len(self._queue),
+                "max_queue_depth": self.max_queue_depth,
+                "flushes": self.flushes,
+                "samples_written": self.samples_written,
+                "errors": self.errors,
+                "failed_samples": self.failed_samples,
+                "last_flush_latency": self.last_flush_latency,
+                "max_flush_latency": self.max_flush_latency}
+
+    def close(self):
+        # Flush what is left and stop the writer thread
+        self._running = False
+        self._wakeup.set()
+        self._thread.join()
@@ -16,7 +16,7 @@ redis_url = 'redis://nott-server.ster.kuleuven.be:6379'
 # TODO: measure visibility
 # =============================================================================
 import nott_control
-from nott_database import define_time, get_field
+from nott_database import define_time, get_field, get_reduced
 
     
 def build_kappa_matrix(delay, shutter_radiation, n_aper, fields, return_throughput):
@@ -92,8 +92,8 @@ def build_kappa_matrix(delay, shutter_radiation, n_aper, fields, return_throughp
         start, end = define_time(delay)
         time.sleep(delay) # Wait for the lag between the camera and the database
         
-        fluxes_shutters_closed = [get_field(elt, start, end, True)[1] for elt in fields]
-        fluxes_shutters_closed = np.array(fluxes_shutters_closed)
+        # All fields in one query; average over the frames of each field, computed by the database
+        fluxes_shutters_closed = get_reduced(fields, start, end)[0]
 
         detbg_shutters_closed = fluxes_shutters_closed[-1] # Ambient thermal background and detector noise
         fluxes_shutters_closed = fluxes_shutters_closed[:-1] # Flux at the outputs
@@ -105,8 +105,7 @@ def build_kappa_matrix(delay, shutter_radiation, n_aper, fields, return_throughp
         start, end = define_time(delay)    
         time.sleep(delay) # Wait for the lag between the camera and the database
 
-        fluxes = [get_field(elt, start, end, True)[1] for elt in fields]
-        fluxes = np.array(fluxes)
+        fluxes = get_reduced(fields, start, end)[0]
 
         detbg = fluxes[-1] # Ambient thermal background and detector noise
         fluxes = fluxes[:-1] # Flux at the outputs
@@ -170,8 +169,7 @@ def get_shutter_radiation(n_aper, delay, fields):
         start, end = define_time(delay)
         time.sleep(delay) # Wait for the lag between the camera and the database
 
-        fluxes_bg = [get_field(elt, start, end, True)[1] for elt in fields]
-        fluxes_bg = np.array(fluxes_bg)        
+        fluxes_bg = get_reduced(fields, start, end)[0]
         shift_bg = fluxes_bg[-1]
         fluxes_bg = fluxes_bg[:-1]
         
@@ -182,8 +180,7 @@ def get_shutter_radiation(n_aper, delay, fields):
         start, end = define_time(delay)    
         time.sleep(delay)    # Wait for the lag between the camera and the database     
         
-        fluxes = [get_field(elt, start, end, True)[1] for elt in fields]
-        fluxes = np.array(fluxes)       
+        fluxes = get_reduced(fields, start, end)[0]
         detbg = fluxes[-1]
         fluxes = fluxes[:-1]
 
@@ -9,6 +9,7 @@ from nott_figure import move_figure
 from nott_file import save_data
 from nott_fringes import fringes, fringes_env, envelop_detector
 from nott_database import define_time, get_field
+from nott_join import interpolate, monotone_order
 
 # Import functions
 import time
@@ -19,13 +20,11 @@ import matplotlib.pyplot as plt
 from matplotlib.animation import FuncAnimation
 from configparser import ConfigParser
 from scipy.optimize import curve_fit
-from scipy.interpolate import interp1d
 
 def interpolate_ts(arr1, arr2):
 
-    f = interp1d(arr1[:,0], arr1[:,1], bounds_error=False, fill_value=arr1[:,1].mean(), kind='cubic')
-
-    interp_value = f(arr2[:,0])
+    # Monotone cubic join of arr1 on the timestamps of arr2 (mean of arr1 outside its time range)
+    interp_value = interpolate(arr1[:,0], arr1[:,1], arr2[:,0], mode="pchip", fill=arr1[:,1].mean())
 
     interp_arr = np.vstack((arr2[:,0], interp_value))
     interp_arr = interp_arr.T
@@ -52,8 +51,8 @@ def do_scans(dl_name, dl_end_pos, speed, opcua_motor, field_of_interest, delay,
     data_IA = data_IA[:,1]
     dl_pos = dl_pos[:,1]
 
-    # Rearrange
-    idx = np.argsort(dl_pos)
+    # Rearrange (no sort needed if the positions are already monotonic)
+    idx = monotone_order(dl_pos)
     data_IA = data_IA[idx]
     dl_pos = dl_pos[idx]
 
@@ -0,0 +1,194 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Sat Oct 17 10:52:19 2026
+
+Behaviour tests of the fused calibration kernels (camera/calibration.py), against the float64 formulas of
+Frame.calib_seq / Frame.calib_master they replace: dark subtraction, subtraction of the mean background ROI and
+error propagation, and the spectra (ROI rows summed) of the NIFITS format.
+Bad pixels are replaced by the mean of the good pixels of their ROI row.
+
+Run with pytest, or directly: python test_calibration.py
+
+"""
+
+import numpy as np
+from nottcontrol.camera.calibration import calib_rois_seq, calib_full_seq, calib_rows
+
+bg_roi_idx = [0, 9]
+
+
+def _data(nroi=10, n=70, h=12, w=5, seed=3):
+    rng = np.random.default_rng(seed)
+    rois_data = rng.integers(900, 1400, (nroi, n, h, w)).astype(np.uint16)
+    dark_mean = rng.normal(1000., 10., (nroi, h, w))
+    dark_mean_std = np.abs(rng.normal(2., 0.5, (nroi, h, w)))
+    bad = rng.random((nroi, h, w)) < 0.05
+    # A row with a single good pixel, and a row without any
+    bad[3, 2, :-1] = True
+    bad[4, 5, :] = True
+    return rois_data, dark_mean, dark_mean_std, bad
+
+
+def _fill_rows(values, bad):
+    # Bad pixels to the mean of the good pixels of their row (0 if the row has none), float64
+    values = np.array(values, dtype=np.float64)
+    good = np.broadcast_to(~bad, values.shape)
+    ngood = good.sum(axis=-1, keepdims=True)
+    row_mean = np.where(good, values, 0.).sum(axis=-1, keepdims=True) / np.maximum(ngood, 1)
+    return np.where(good, values, row_mean)
+
+
+def reference_rois_seq(rois_data, dark_mean, dark_mean_std, bad=None):
+    # Frame.calib_seq (not full), in float64, with bad pixels replaced in the dark-subtracted frames and in the std map
+    cal_seq = rois_data - dark_mean[:, np.newaxis]
+    cal_seq_std = np.hypot(np.std(rois_data, axis=1), dark_mean_std)
+    if bad is not None:
+        cal_seq = _fill_rows(cal_seq, bad[:, np.newaxis])
+        cal_seq_std = _fill_rows(cal_seq_std, bad)
+    N = len(bg_roi_idx)
+    cal_meanbg_seq = np.average(cal_seq[bg_roi_idx], axis=0)
+    cal_meanbg_seq_err = np.linalg.norm(cal_seq_std[bg_roi_idx], axis=0) / N
+    cal_seq = cal_seq - cal_meanbg_seq[np.newaxis]
+    cal_seq_std = np.hypot(cal_seq_std, cal_meanbg_seq_err[np.newaxis])
+    return cal_seq, cal_seq_std
+
+
+def reference_master(sci_mean, sci_mean_std, dark_mean, dark_mean_std):
+    # Frame.calib_master (not full), in float64
+    cal_mean = sci_mean - dark_mean
+    cal_mean_std = np.hypot(sci_mean_std, dark_mean_std)
+    N = len(bg_roi_idx)
+    cal_meanbg_mean = np.average(cal_mean[bg_roi_idx], axis=0)
+    cal_meanbg_mean_std = np.linalg.norm(cal_mean_std[bg_roi_idx], axis=0) / N
+    cal_mean = cal_mean - cal_meanbg_mean[np.newaxis]
+    cal_mean_std = np.hypot(cal_mean_std, cal_meanbg_mean_std[np.newaxis])
+    return cal_mean, cal_mean_std
+
+
+def reference_rows_std(sci_std, dark_mean_std, bad):
+    # Std of the spectra with bad pixels: per-pixel std (bad pixels replaced), plus the mean background error, summed
+    # over the good pixels of the row, each counting for the bad pixels of that row as well
+    std = _fill_rows(np.hypot(sci_std, dark_mean_std), bad)
+    bg_err = np.linalg.norm(std[bg_roi_idx], axis=0) / len(bg_roi_idx)
+    good = ~bad
+    weights = good * bad.shape[-1] / np.maximum(good.sum(axis=-1, keepdims=True), 1)
+    return (np.hypot(std, bg_err[np.newaxis]) * weights).sum(axis=-1)
+
+
+def _close(a, b, scale):
+    # float32 kernels: relative to the scale of the values
+    return np.allclose(a, b, rtol=0, atol=1e-5*scale)
+
+
+def test_calib_rois_seq():
+    rois_data, dark_mean, dark_mean_std, _ = _data()
+    ref, ref_std = reference_rois_seq(rois_data, dark_mean, dark_mean_std)
+    for chunk in (1, 32, 200):
+        cal, cal_std = calib_rois_seq(rois_data, dark_mean, dark_mean_std, bg_roi_idx, chunk=chunk)
+        assert cal.dtype == np.float32 and cal.shape == rois_data.shape
+        assert _close(cal, ref, 1e3) and _close(cal_std, ref_std, 1e3)
+
+
+def test_calib_rois_seq_bad():
+    rois_data, dark_mean, dark_mean_std, bad = _data()
+    ref, ref_std = reference_rois_seq(rois_data, dark_mean, dark_mean_std, bad)
+    cal, cal_std = calib_rois_seq(rois_data, dark_mean, dark_mean_std, bg_roi_idx, bad=bad)
+    assert _close(cal, ref, 1e3) and _close(cal_std, ref_std, 1e3)
+
+
+def test_calib_rois_seq_buffers():
+    rois_data, dark_mean, dark_mean_std, _ = _data(n=9)
+    out = np.empty(rois_data.shape, dtype=np.float32)
+    out_std = np.empty((rois_data.shape[0],)+rois_data.shape[2:], dtype=np.float32)
+    cal, cal_std = calib_rois_seq(rois_data, dark_mean, dark_mean_std, bg_roi_idx, out, out_std)
+    assert cal is out and cal_std is out_std
+
+
+def test_calib_full_seq():
+    rois_data, dark_mean, dark_mean_std, bad = _data()
+    # Full frames: dark subtraction only
+    data, dark, dark_std, bad = rois_data[1], dark_mean[1], dark_mean_std[1], bad[1]
+    cal, cal_std = calib_full_seq(data, dark, dark_std, chunk=16)
+    assert _close(cal, data - dark[np.newaxis], 1e3)
+    assert _close(cal_std, np.hypot(np.std(data, axis=0), dark_std), 1e3)
+    cal, cal_std = calib_full_seq(data, dark, dark_std, bad=bad)
+    assert _close(cal, _fill_rows(data - dark[np.newaxis], bad), 1e3)
+    assert _close(cal_std, _fill_rows(np.hypot(np.std(data, axis=0), dark_std), bad), 1e3)
+    # A row with a single good pixel takes its value
+    row = np.zeros(bad.shape, dtype=bool)
+    row[2, :-1] = True
+    cal, _ = calib_full_seq(data, dark, dark_std, bad=row)
+    assert np.array_equal(cal[:, 2, 0], cal[:, 2, -1])
+
+
+def test_calib_rows_seq():
+    rois_data, dark_mean, dark_mean_std, _ = _data()
+    ref, ref_std = reference_rois_seq(rois_data, dark_mean, dark_mean_std)
+    # calib_seq_nifits_format: (N,h,roi)
+    ref, ref_std = ref.sum(axis=-1).transpose((1, 2, 0)), ref_std.sum(axis=-1).T[np.newaxis]
+    for chunk in (1, 32):
+        cal, cal_std = calib_rows(rois_data, dark_mean, dark_mean_std, bg_roi_idx, chunk=chunk)
+        assert _close(cal, ref, 1e4) and _close(cal_std, np.broadcast_to(ref_std, cal_std.shape), 1e4)
+
+    # Selected rows only, from given raw row sums as well
+    row_mask = np.zeros(rois_data.shape[2], dtype=bool)
+    row_mask[[1, 4, 5, 6, 11]] = True
+    row_sums = rois_data[:, :, row_mask].sum(axis=-1)
+    for sums in (None, row_sums):
+        cal, cal_std = calib_rows(rois_data, dark_mean, dark_mean_std, bg_roi_idx, row_mask=row_mask, row_sums=sums)
+        assert np.isnan(cal[:, ~row_mask]).all() and np.isnan(cal_std[:, ~row_mask]).all()
+        assert _close(cal[:, row_mask], ref[:, row_mask], 1e4)
+        assert _close(cal_std[:, row_mask], np.broadcast_to(ref_std[:, row_mask], cal_std[:, row_mask].shape), 1e4)
+
+
+def test_calib_rows_seq_bad():
+    rois_data, dark_mean, dark_mean_std, bad = _data()
+    ref, _ = reference_rois_seq(rois_data, dark_mean, dark_mean_std, bad)
+    ref = ref.sum(axis=-1).transpose((1, 2, 0))
+    ref_std = reference_rows_std(np.std(rois_data, axis=1), dark_mean_std, bad).T
+    row_mask = np.ones(rois_data.shape[2], dtype=bool)
+    row_mask[3] = False
+    # Row sums are recomputed with the bad pixel weights, whether given or not
+    for sums in (None, rois_data[:, :, row_mask].sum(axis=-1)):
+        cal, cal_std = calib_rows(rois_data, dark_mean, dark_mean_std, bg_roi_idx, row_mask=row_mask, row_sums=sums, bad=bad)
+        assert _close(cal[:, row_mask], ref[:, row_mask], 1e4)
+        assert _close(cal_std[0, row_mask], ref_std[row_mask], 1e4)
+
+
+def test_calib_rows_master():
+    rois_data, dark_mean, dark_mean_std, bad = _data()
+    n = rois_data.shape[1]
+    sci_mean, sci_mean_std = rois_data.mean(axis=1), np.std(rois_data, axis=1) / np.sqrt(n)
+    ref, ref_std = reference_master(sci_mean, sci_mean_std, dark_mean, dark_mean_std)
+    # calib_master_nifits_format: (h,roi)
+    ref, ref_std = ref.sum(axis=-1).T, ref_std.sum(axis=-1).T
+    cal, cal_std = calib_rows(rois_data, dark_mean, dark_mean_std, bg_roi_idx, master=True)
+    assert _close(cal, ref, 1e4) and _close(cal_std, ref_std, 1e4)
+    # From the master frame of the sequence: the same
+    cal, cal_std = calib_rows(rois_data, dark_mean, dark_mean_std, bg_roi_idx, master=True, master_rois=(sci_mean, sci_mean_std))
+    assert _close(cal, ref, 1e4) and _close(cal_std, ref_std, 1e4)
+
+    # Another master frame (e.g. sigma-clipped): calibrated from that master, not from the frames
+    sci_mean, sci_mean_std = sci_mean + 7.*np.arange(len(sci_mean))[:, np.newaxis, np.newaxis], 2*sci_mean_std
+    ref, ref_std = reference_master(sci_mean, sci_mean_std, dark_mean, dark_mean_std)
+    ref, ref_std = ref.sum(axis=-1).T, ref_std.sum(axis=-1).T
+    cal, cal_std = calib_rows(rois_data, dark_mean, dark_mean_std, bg_roi_idx, master=True, master_rois=(sci_mean, sci_mean_std))
+    assert _close(cal, ref, 1e4) and _close(cal_std, ref_std, 1e4)
+
+    # With bad pixels, and selected rows
+    row_mask = np.zeros(rois_data.shape[2], dtype=bool)
+    row_mask[2:9] = True
+    ref, _ = reference_master(_fill_rows(sci_mean - dark_mean, bad) + dark_mean, sci_mean_std, dark_mean, dark_mean_std)
+    ref = ref.sum(axis=-1).T
+    ref_std = reference_rows_std(sci_mean_std, dark_mean_std, bad).T
+    cal, cal_std = calib_rows(rois_data, dark_mean, dark_mean_std, bg_roi_idx, row_mask=row_mask, master=True, bad=bad,
+                              master_rois=(sci_mean, sci_mean_std))
+    assert np.isnan(cal[~row_mask]).all()
+    assert _close(cal[row_mask], ref[row_mask], 1e4) and _close(cal_std[row_mask], ref_std[row_mask], 1e4)
+
+
+if __name__ == "__main__":
+    for name, test in list(globals().items()):
+        if name.startswith("test_"):
+            test()
+            print(f"{name}: OK")
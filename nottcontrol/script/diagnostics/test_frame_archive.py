@@ -0,0 +1,91 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Sat Oct 17 11:46:02 2026
+
+Behaviour tests of the compressed frame archive (camera/frame_archive.py): frames are decoded bit for bit as they
+were written, by chunk and through FrameArchiveReader, for every available codec.
+
+Run with pytest, or directly: python test_frame_archive.py
+
+"""
+
+import tempfile
+import numpy as np
+from datetime import datetime, timedelta
+from pathlib import Path
+from nottcontrol.camera.frame_archive import (FrameArchive, FrameArchiveReader, encode_chunk, decode_chunk,
+                                              default_codec)
+from nottcontrol.camera.frame_store import unix_time_ms
+
+t0 = datetime(2026, 10, 17, 11, 0)
+
+
+def _codecs():
+    return sorted({"zlib", default_codec()})
+
+
+def _frames(n=100, shape=(20, 30), seed=6):
+    rng = np.random.default_rng(seed)
+    frames = rng.integers(0, 2**16, (n,)+shape, dtype=np.uint16)
+    # Smooth frames as well, and the extreme values (wrap around of the row deltas)
+    frames[::3] = 1000 + np.arange(shape[1], dtype=np.uint16)
+    frames[1, 0] = [0, 2**16-1] * (shape[1]//2)
+    return frames
+
+
+def test_chunk_round_trip():
+    frames = _frames(n=17)
+    for codec in _codecs():
+        buf = encode_chunk(frames, codec)
+        assert np.array_equal(decode_chunk(buf, len(frames), frames.shape[1:], frames.dtype, codec), frames)
+        out = np.empty_like(frames)
+        decode_chunk(buf, len(frames), frames.shape[1:], frames.dtype, codec, out=out)
+        assert np.array_equal(out, frames)
+
+
+def test_archive_round_trip():
+    frames = _frames()
+    stamps = np.array([unix_time_ms(t0 + timedelta(milliseconds=5*k)) for k in range(len(frames))])
+    integtimes = np.where(np.arange(len(frames)) < 50, 1000., -1.)
+    for codec in _codecs():
+        with tempfile.TemporaryDirectory() as directory:
+            archive = FrameArchive(directory, chunk_frames=16, codec=codec)
+            archive.open(t0, frames.shape[1:], frames.dtype)
+            # Appended in two calls of whole chunks, the last chunk of the archive is short (100 = 6*16 + 4)
+            archive.append(frames[:48], stamps[:48], integtimes[:48])
+            archive.append(frames[48:], stamps[48:], integtimes[48:])
+            archive.close()
+
+            reader = FrameArchiveReader(directory)
+            data, found, found_integtimes = reader.read_range(stamps[0], stamps[-1])
+            assert np.array_equal(data, frames) and np.array_equal(found, stamps)
+            assert np.array_equal(found_integtimes, integtimes)
+            # Ranges within and across chunks
+            for k1, k2 in ((0, 1), (15, 17), (20, 90), (96, 100)):
+                data, found, _ = reader.read_range(stamps[k1], stamps[k2-1])
+                assert np.array_equal(data, frames[k1:k2]) and np.array_equal(found, stamps[k1:k2])
+            ids = [(t0 + timedelta(milliseconds=5*k)).strftime("%Y%m%d_%H%M%S%f")[:-3] for k in (3, 40, 99)]
+            assert np.array_equal(reader.read_ids(ids), frames[[3, 40, 99]])
+
+
+def test_archive_indexing():
+    frames = _frames(n=40)
+    stamps = np.array([unix_time_ms(t0 + timedelta(milliseconds=5*k)) for k in range(len(frames))])
+    with tempfile.TemporaryDirectory() as directory:
+        archive = FrameArchive(directory, chunk_frames=8, codec="zlib")
+        archive.open(t0, frames.shape[1:], frames.dtype)
+        archive.append(frames, stamps, np.full(len(frames), 1000.))
+        archive.close()
+        prefix = Path(directory).joinpath(t0.strftime("%Y%m%d"), "arc_" + t0.strftime("%H%M%S%f")[:-3])
+        data, _ = FrameArchiveReader._open(str(prefix))
+        assert len(data) == len(frames)
+        assert np.array_equal(data[5], frames[5])
+        assert np.array_equal(data[-1], frames[-1])
+        assert np.array_equal(data[np.array([39, 0, 17])], frames[[39, 0, 17]])
+
+
+if __name__ == "__main__":
+    for name, test in list(globals().items()):
+        if name.startswith("test_"):
+            test()
+            print(f"{name}: OK")
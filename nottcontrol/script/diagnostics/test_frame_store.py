@@ -0,0 +1,106 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Sat Oct 17 10:12:36 2026
+
+Behaviour tests of the segment store (camera/frame_store.py): frames written by FrameStore are read back unchanged
+by FrameStoreReader, and segments are truncated to the written frames on close.
+
+Run with pytest, or directly: python test_frame_store.py
+
+"""
+
+import tempfile
+import numpy as np
+from datetime import datetime, timedelta
+from pathlib import Path
+from nottcontrol.camera.frame_store import FrameStore, FrameStoreReader, truncate_npy, unix_time_ms
+
+t0 = datetime(2026, 10, 17, 9, 30)
+
+
+def _frames(n, shape=(512, 512), seed=0):
+    return np.random.default_rng(seed).integers(0, 2**16, (n,)+shape, dtype=np.uint16)
+
+
+def _record(base_path, frames, step_ms=10):
+    # 512x512 uint16 frames: two frames per 1 MB segment
+    store = FrameStore(base_path, segment_size_mb=1, flush_every=3)
+    stamps = [t0 + timedelta(milliseconds=step_ms*k) for k in range(len(frames))]
+    for k, frame in enumerate(frames):
+        store.append(frame, stamps[k], 1000. + k)
+    store.close()
+    return np.array([unix_time_ms(stamp) for stamp in stamps])
+
+
+def test_truncate_npy():
+    for version in ((1, 0), (2, 0)):
+        with tempfile.TemporaryDirectory() as directory:
+            path = str(Path(directory).joinpath("a.npy"))
+            data = np.arange(10*3*4, dtype=np.int32).reshape((10, 3, 4))
+            array = np.lib.format.open_memmap(path, mode="w+", dtype=data.dtype, shape=data.shape, version=version)
+            array[:] = data
+            del array
+            truncate_npy(path, 4)
+            assert np.array_equal(np.load(path), data[:4])
+            # Not grown, nor cut further than needed
+            truncate_npy(path, 8)
+            assert np.array_equal(np.load(path), data[:4])
+            truncate_npy(path, 0)
+            assert np.load(path).shape == (0, 3, 4)
+
+
+def test_round_trip():
+    frames = _frames(5)
+    with tempfile.TemporaryDirectory() as directory:
+        stamps = _record(directory, frames)
+        reader = FrameStoreReader(directory)
+
+        data, found, integtimes = reader.read_range(stamps[0], stamps[-1])
+        assert np.array_equal(found, stamps)
+        assert np.array_equal(data, frames)
+        assert np.array_equal(integtimes, 1000. + np.arange(5))
+
+        # Within one segment, across segments, and outside of the recording
+        data, found, _ = reader.read_range(stamps[0], stamps[1])
+        assert np.array_equal(data, frames[:2])
+        data, found, _ = reader.read_range(stamps[1]-1, stamps[3]+1)
+        assert np.array_equal(found, stamps[1:4]) and np.array_equal(data, frames[1:4])
+        data, found, _ = reader.read_range(stamps[-1]+1, stamps[-1]+100)
+        assert data is None and len(found) == 0
+
+        ids = [(t0 + timedelta(milliseconds=10*k)).strftime("%Y%m%d_%H%M%S%f")[:-3] for k in (0, 2, 4)]
+        assert np.array_equal(reader.read_ids(ids), frames[[0, 2, 4]])
+        assert reader.read_ids(ids[:1] + ["20261017_093000005"]) is None
+
+
+def test_segments_truncated():
+    frames = _frames(5)
+    with tempfile.TemporaryDirectory() as directory:
+        _record(directory, frames)
+        segments = sorted(Path(directory).joinpath(t0.strftime("%Y%m%d")).glob("seg_*.index.npy"))
+        counts = [len(np.load(path)) for path in segments]
+        assert counts == [2, 2, 1]
+        for path in segments:
+            prefix = str(path)[:-len(".index.npy")]
+            assert np.load(prefix+".frames.npy", mmap_mode="r").shape[0] == len(np.load(path))
+
+
+def test_stamps_increase():
+    frames = _frames(2, shape=(4, 4))
+    with tempfile.TemporaryDirectory() as directory:
+        store = FrameStore(directory)
+        store.append(frames[0], t0, 1000.)
+        try:
+            store.append(frames[1], t0, 1000.)
+            raise AssertionError("A frame not stamped after the previous one was stored")
+        except ValueError:
+            pass
+        finally:
+            store.close()
+
+
+if __name__ == "__main__":
+    for name, test in list(globals().items()):
+        if name.startswith("test_"):
+            test()
+            print(f"{name}: OK")
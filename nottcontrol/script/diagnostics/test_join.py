@@ -0,0 +1,117 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Sat Oct 17 12:08:55 2026
+
+Behaviour tests of the merge-join of timestamped series (script/lib/nott_join.py): the batch join against numpy and
+scipy interpolation, and the incremental StreamJoin against the batch join, whatever the arrival of the datapoints.
+
+Run with pytest, or directly: python test_join.py
+
+"""
+
+import numpy as np
+from scipy.interpolate import PchipInterpolator
+from nottcontrol.script.lib.nott_join import interpolate, join, StreamJoin, modes, monotone_order
+
+
+def _series(seed=7, n_src=80, n_dst=300):
+    rng = np.random.default_rng(seed)
+    # Delay line positions at irregular times, ROI values at the frame times (also before and after the positions)
+    t_src = np.cumsum(rng.uniform(5., 40., n_src))
+    source = np.column_stack((t_src, np.cumsum(rng.normal(0., 1., n_src))))
+    t_dst = np.sort(rng.uniform(t_src[0] - 50., t_src[-1] + 50., n_dst))
+    target = np.column_stack((t_dst, rng.normal(0., 1., n_dst)))
+    return source, target
+
+
+def test_interpolate():
+    source, target = _series()
+    t, v, t_dst = source[:,0], source[:,1], target[:,0]
+    inside = (t_dst >= t[0]) & (t_dst <= t[-1])
+    linear = interpolate(t, v, t_dst, "linear")
+    assert np.allclose(linear[inside], np.interp(t_dst[inside], t, v)) and np.isnan(linear[~inside]).all()
+    pchip = interpolate(t, v, t_dst, "pchip", fill=0.)
+    assert np.allclose(pchip[inside], PchipInterpolator(t, v)(t_dst[inside])) and (pchip[~inside] == 0.).all()
+    previous = interpolate(t, v, t_dst, "previous")
+    j = np.searchsorted(t, t_dst, side="right") - 1
+    assert np.array_equal(previous[j >= 0], v[j[j >= 0]]) and np.isnan(previous[j < 0]).all()
+    # Unsorted source (reverted scan) and unsorted targets
+    order = np.random.default_rng(8).permutation(len(t))
+    assert np.allclose(interpolate(t[order], v[order], t_dst[::-1], "pchip")[::-1], interpolate(t, v, t_dst, "pchip"),
+                       equal_nan=True)
+    try:
+        interpolate(t, v, t_dst, "cubic")
+        raise AssertionError("Unknown join mode accepted")
+    except ValueError:
+        pass
+
+
+def test_join():
+    source, target = _series()
+    joined = join(source, target, "linear")
+    assert joined.shape == (len(target), 3)
+    assert np.array_equal(joined[:,0], target[:,0]) and np.array_equal(joined[:,2], target[:,1])
+    assert np.array_equal(joined[:,1], interpolate(source[:,0], source[:,1], target[:,0], "linear"), equal_nan=True)
+
+
+def _stream(mode, source, target, seed):
+    # Feed the datapoints in random batches, in time order of arrival, popping as we go
+    rng = np.random.default_rng(seed)
+    stream = StreamJoin(mode)
+    events = sorted([(t, 0, k) for k, t in enumerate(source[:,0])] + [(t, 1, k) for k, t in enumerate(target[:,0])])
+    out = []
+    k = 0
+    while k < len(events):
+        batch = events[k:k+rng.integers(1, 12)]
+        k += len(batch)
+        src = [source[i] for t, kind, i in batch if kind == 0]
+        dst = [target[i] for t, kind, i in batch if kind == 1]
+        if len(src):
+            stream.add_source(src)
+        if len(dst):
+            stream.add_target(dst)
+        if rng.random() < 0.5:
+            out.append(stream.pop())
+    out.append(stream.pop())
+    out.append(stream.flush())
+    return np.concatenate(out)
+
+
+def test_stream_join():
+    source, target = _series()
+    for mode in modes:
+        batch = join(source, target, mode)
+        for seed in range(5):
+            streamed = _stream(mode, source, target, seed)
+            assert np.array_equal(streamed[:,0], batch[:,0]) and np.array_equal(streamed[:,2], batch[:,2])
+            assert np.allclose(streamed[:,1], batch[:,1], rtol=0, atol=1e-9, equal_nan=True)
+
+
+def test_stream_pop_final():
+    # Popped datapoints are final: no later source datapoint changes them
+    source, target = _series()
+    for mode in modes:
+        stream = StreamJoin(mode)
+        stream.add_target(target)
+        popped = []
+        for point in source:
+            stream.add_source(point)
+            popped.append(stream.pop())
+        popped = np.concatenate(popped)
+        batch = join(source, target, mode)[:len(popped)]
+        assert np.allclose(popped[:,1], batch[:,1], rtol=0, atol=1e-9, equal_nan=True)
+
+
+def test_monotone_order():
+    x = np.array([1., 2., 2., 5.])
+    assert monotone_order(x) == slice(None)
+    assert np.array_equal(x[::-1][monotone_order(x[::-1])], x)
+    y = np.array([3., 1., 2.])
+    assert np.array_equal(y[monotone_order(y)], np.sort(y))
+
+
+if __name__ == "__main__":
+    for name, test in list(globals().items()):
+        if name.startswith("test_"):
+            test()
+            print(f"{name}: OK")
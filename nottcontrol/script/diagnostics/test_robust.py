@@ -0,0 +1,97 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Sat Oct 17 11:24:47 2026
+
+Behaviour tests of the robust master frame combiners (camera/robust.py): the streaming sigma clipping gives, pixel
+by pixel, the result of a plain iterative sigma clipping of that pixel's values. The bad pixel mask only applies
+to frames of the camera window it was learned in.
+
+Run with pytest, or directly: python test_robust.py
+
+"""
+
+import tempfile
+import numpy as np
+from pathlib import Path
+from nottcontrol.camera.robust import sigma_clip, combine, BadPixelMap
+
+
+def reference_sigma_clip(values, nsigma=3., iterations=3):
+    # Iterative sigma clipping of one pixel: mean and std of the values within nsigma std of the previous mean
+    mean, std, kept = values.mean(), values.std(), len(values)
+    for _ in range(iterations):
+        keep = np.abs(values - mean) <= nsigma * std
+        if not keep.any():
+            break
+        mean, std, kept = values[keep].mean(), values[keep].std(), keep.sum()
+    return mean, std / np.sqrt(kept)
+
+
+def _frames(n=60, shape=(5, 4), seed=4):
+    rng = np.random.default_rng(seed)
+    frames = rng.normal(1000., 5., (n,)+shape)
+    # Cosmics and a flickering pixel
+    frames[7, 1, 2] += 400.
+    frames[30, 3, 0] -= 250.
+    frames[::5, 0, 0] += 60.
+    # Constant pixel: zero std, nothing clipped
+    frames[:, 4, 3] = 1000.
+    return frames
+
+
+def test_sigma_clip():
+    frames = _frames()
+    for nsigma, iterations in ((3., 3), (2., 5), (1., 1)):
+        for chunk in (7, 64):
+            master, master_std = sigma_clip(frames, nsigma=nsigma, iterations=iterations, chunk=chunk)
+            for pixel in np.ndindex(frames.shape[1:]):
+                mean, std = reference_sigma_clip(frames[(slice(None),)+pixel], nsigma, iterations)
+                assert np.isclose(master[pixel], mean, rtol=0, atol=1e-9)
+                assert np.isclose(master_std[pixel], std, rtol=1e-9, atol=1e-12)
+
+
+def test_sigma_clip_axis():
+    # ROI stacks are (roi,N,h,w), clipped along axis 1
+    frames = _frames()
+    stack = np.stack([frames, frames + 10.])
+    master, master_std = sigma_clip(stack, axis=1, chunk=16)
+    reference, reference_std = sigma_clip(frames)
+    assert np.allclose(master[0], reference) and np.allclose(master[1], reference + 10.)
+    assert np.allclose(master_std[0], reference_std) and np.allclose(master_std[1], reference_std)
+
+
+def test_outliers_rejected():
+    frames = _frames()
+    master, _ = sigma_clip(frames)
+    mean, _ = combine(frames, "mean")
+    # The cosmic moves the plain mean, not the clipped one
+    assert abs(mean[1, 2] - 1000.) > 5. and abs(master[1, 2] - 1000.) < 2.
+    assert master[4, 3] == 1000.
+
+
+def test_bad_pixel_window():
+    rng = np.random.default_rng(5)
+    master, master_std = rng.normal(1000., 1., (6, 8)), rng.normal(2., 0.1, (6, 8))
+    master[2, 3] = 5000.
+    window = {"x": 100, "y": 40, "w": 8, "h": 6}
+    with tempfile.TemporaryDirectory() as directory:
+        path = Path(directory).joinpath("bad_pixels.npz")
+        mask = BadPixelMap(path)
+        mask.learn(master, master_std, window)
+        mask.save()
+        # Kept with its window
+        mask = BadPixelMap(path)
+        assert mask.full(window, (6, 8))[2, 3] and mask.full(window, (6, 8)).sum() == 1
+        # Window moved, not resized: not applied
+        assert mask.full(dict(window, x=101), (6, 8)) is None
+        # A dark in the new window starts a new mask
+        master[2, 3] = 1000.
+        mask.learn(master, master_std, dict(window, x=101))
+        assert mask.window == (101, 40, 8, 6) and mask.full(dict(window, x=101), (6, 8)) is None
+
+
+if __name__ == "__main__":
+    for name, test in list(globals().items()):
+        if name.startswith("test_"):
+            test()
+            print(f"{name}: OK")
@@ -0,0 +1,68 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Sat Oct 17 10:31:04 2026
+
+Behaviour tests of the streaming master frame accumulator (camera/welford.py): per-frame, chunked and merged
+accumulation give the mean and (population) std of np.mean/np.std over the whole stack.
+
+Run with pytest, or directly: python test_welford.py
+
+"""
+
+import numpy as np
+from nottcontrol.camera.welford import WelfordAccumulator
+
+
+def _frames(n=37, shape=(6, 5), seed=1):
+    # Large offset: a two-pass formula is exact, a naive sum of squares would not be
+    return 30000. + np.random.default_rng(seed).normal(0, 3, (n,)+shape)
+
+
+def test_add():
+    frames = _frames()
+    acc = WelfordAccumulator()
+    for frame in frames:
+        acc.add(frame)
+    assert acc.count == len(frames)
+    assert np.allclose(acc.mean, frames.mean(axis=0), rtol=0, atol=1e-9)
+    assert np.allclose(acc.std(), frames.std(axis=0), rtol=1e-9)
+
+
+def test_add_batch():
+    frames = _frames()
+    for axis in (0, 1):
+        stack = np.moveaxis(frames, 0, axis)
+        for chunk in (1, 8, 64):
+            acc = WelfordAccumulator()
+            acc.add_batch(stack, axis=axis, chunk=chunk)
+            assert np.allclose(acc.mean, stack.mean(axis=axis), rtol=0, atol=1e-9)
+            assert np.allclose(acc.std(), stack.std(axis=axis), rtol=1e-9)
+
+
+def test_uint16_frames():
+    frames = np.random.default_rng(2).integers(0, 2**16, (20, 4, 4), dtype=np.uint16)
+    acc = WelfordAccumulator()
+    acc.add_batch(frames, chunk=6)
+    assert np.allclose(acc.mean, frames.mean(axis=0))
+    assert np.allclose(acc.std(), frames.std(axis=0))
+
+
+def test_merge_and_result():
+    frames = _frames()
+    first, second = WelfordAccumulator(), WelfordAccumulator()
+    first.add_batch(frames[:10])
+    second.add_batch(frames[10:])
+    first.merge(second.count, second.mean, second.m2)
+    master, master_std = first.result()
+    assert np.allclose(master, frames.mean(axis=0), rtol=0, atol=1e-9)
+    assert np.allclose(master_std, frames.std(axis=0) / np.sqrt(len(frames)), rtol=1e-9)
+    # Merging nothing changes nothing
+    first.merge(0, None, None)
+    assert first.count == len(frames)
+
+
+if __name__ == "__main__":
+    for name, test in list(globals().items()):
+        if name.startswith("test_"):
+            test()
+            print(f"{name}: OK")
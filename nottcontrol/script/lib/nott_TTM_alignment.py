@@ -75,6 +75,10 @@ from nottcontrol.components.motor import Motor
 # Functions for retrieving data from REDIS
 from nottcontrol.script.lib.nott_database import define_time
 from nottcontrol.script.lib.nott_database import get_field
+from nottcontrol.script.lib.nott_database import get_fields
+from nottcontrol.script.lib.nott_database import get_reduced
+from nottcontrol.script.lib.nott_database import enable_cache
+from nottcontrol.script.lib.nott_database import get_cam_delay
 # Shutter control
 from nottcontrol.script.lib.nott_control import all_shutters_close
 from nottcontrol.script.lib.nott_control import all_shutters_open
@@ -87,7 +91,8 @@ from nottcontrol.script import data_files
 # Opcua address
 url =  nott_config['DEFAULT']['opcuaaddress']
 # Global parameters
-t_write = int(nott_config['redis']['t_write'])
+# Time for the camera to write its ROI values, including the time they are held in a batch before being written
+t_write = int(nott_config['redis']['t_write']) + int(nott_config['redis']['batch_latency'])
 bool_UT = (nott_config['injection']['bool_UT'] == "True")
 bool_offset = (nott_config['injection']['bool_offset'] == "True")
 fac_loc = int(nott_config['injection']['fac_loc'])
@@ -243,6 +248,10 @@ class alignment:
         # Defining actuator positions corresponding to an aligned & injecting state.
         self.act_pos_align = np.array([[4.1507145,4.6841595,4.8155535,3.714595],[3.6502095,3.4818495,4.5511795,3.8486425],[4.3360325,4.716886,4.754462,3.167242],[4.8310475,4.6418865,4.88122,4.0027285]],dtype=np.float64)
         
+        # Overlapping windows of ROI values are read repeatedly while aligning: keep the recent ones in memory
+        if nott_config['redis']['cache'] == "True":
+            enable_cache()
+        
         '''
         # Opening all shutters
         all_shutters_open(4)
@@ -999,6 +1008,8 @@ class alignment:
             1) The camera takes some time to write its ROI values to redis : on the order of 10 ms.
             2) The internal Infratec camera drifts with time. It seems to tick slower than the Windows lab pc time.
         This function quantifies the delay time, originating from a combination of 1) and 2).
+        The camera clock model (camera/clock_model.py) estimates this delay continuously and publishes it to redis.
+        Only when no recent estimate is published, the delay is measured by probing the database N times.
         
         Parameters
         ----------
@@ -1015,6 +1026,11 @@ class alignment:
 
         '''
         
+        # Continuously estimated delay, published by the camera
+        t_delay = get_cam_delay(average)
+        if t_delay is not None:
+            return t_delay
+        
         delays = []
         for i in range(0, N):
             # Defining a python timeframe (1 second back in time)
@@ -1091,11 +1107,10 @@ class alignment:
             if (j!=0):
                 time.sleep(dt)
             t_start,t_stop = t+j*dt,t+(j+1)*dt
-            # Retrieving REDIS data 
-            exp_av = get_field("roi9_avg",t_start,t_stop,True)
-            exp_full = get_field("roi9_avg",t_start,t_stop,False) 
-            exps.append(exp_av[1])
-            noises.append(exp_full.std(0)[1])
+            # Retrieving REDIS data : mean and std computed by the database, in one query
+            exp_av,exp_std = get_reduced(["roi9_avg"],t_start,t_stop,("mean","std"))[:,0]
+            exps.append(exp_av)
+            noises.append(exp_std)
             
         # Taking the mean 
         mean = np.mean(exps)
@@ -1640,7 +1655,9 @@ class alignment:
         # Readout "dt" seconds back in time
         t_start,t_stop = define_time(dt)
         
-        output = [get_field(names[i],t_start,t_stop,False) for i in range(0,len(names))]
+        # All fields in one query, aligned on the frame timestamps; per field the (timestamp,value) datapoints, as get_field
+        stamps,values = get_fields(names,t_start,t_stop)
+        output = [np.column_stack((stamps,values[i]))[~np.isnan(values[i])] for i in range(0,len(names))]
         
         return output
     
@@ -26,9 +26,13 @@ __status__ = "Production"
 # Import libraries
 import time
 import numpy as np
+from pathlib import Path
 
-from nottcontrol.script.lib.nott_control import shutter_close, shutter_open
-from nottcontrol.script.lib.nott_database import get_data
+from nottcontrol import config
+from nottcontrol.camera.frame import frame_directory
+from nottcontrol.camera.dark_library import DarkLibrary, roi_values
+from nottcontrol.script.lib.nott_control import shutter_close, shutter_open, read_cryo_temperature
+from nottcontrol.script.lib.nott_database import get_data, connection
 
 # Function to cophase the instrument
 def cophase(delay):
@@ -43,7 +47,20 @@ def cophase(delay):
     return avg
 
 # Function to get darks
-def get_darks(delay):
+def get_darks(delay, fresh=False):
+    # Reuse the library dark matching the current camera configuration (see camera/dark_library.py), unless fresh
+    if not fresh:
+        library = DarkLibrary(Path(frame_directory).joinpath("darks"), config['CAMERA'].getfloat('dark_max_age'),
+                              temp_bucket=config['CAMERA'].getfloat('dark_temp_bucket'))
+        integtime = connection().ts().get('cam_integtime')[1]
+        dark = library.lookup(integtime, temperature=read_cryo_temperature())
+        # Only darks stored with their per-frame ROI values (mean per-frame max) can stand in for a measurement
+        values = None if dark is None else roi_values(dark, ['roi1_max', 'roi2_max', 'roi3_max', 'roi4_max'])
+        if values is not None:
+            avg = tuple(values[0])
+            print('Average dark values for the 4 ROIs (library dark):', round(avg[0], 2), round(avg[1], 2), round(avg[2], 2), round(avg[3], 2))
+            return avg
+
     # Close all shutters and take dark measurements
     shutter_close('1')
     shutter_close('2')
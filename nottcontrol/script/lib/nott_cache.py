@@ -0,0 +1,230 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Sat Oct 17 11:02:37 2026
+
+In-process cache of the recent datapoints of subscribed time series (ROI values, delay line positions, integration time).
+
+Per key, the last datapoints are kept in a ring buffer, from which range queries over the last "window" seconds are
+answered without a database round trip (see nott_database.get_field/get_fields). The cache is kept fresh either by
+    - the batched writer of the camera process (RedisBatchWriter.flush_listeners, see attach), or
+    - a background thread fetching only the new datapoints of the keys announced by keyspace notifications
+      (notify-keyspace-events must include module events), or of all keys every "poll" seconds if no notifications arrive.
+A key only answers queries from the time it is known to be complete; older data is read from the database. A query
+ending after the last refresh of its key first refreshes that key, so that it never returns a shorter window than the
+database would.
+
+"""
+
+import threading
+import time
+import numpy as np
+import redis
+from nottcontrol.script.lib.nott_database import connection, ts_range, _parse_points
+from nottcontrol.script.lib.nott_time import unix_time_ms
+
+
+class _Ring(object):
+    # Ring buffer of (timestamp, value) datapoints, in chronological order
+
+    def __init__(self, capacity):
+        self.stamps = np.zeros(capacity, dtype=np.int64)
+        self.values = np.zeros(capacity)
+        self.count = 0
+        # Datapoints are complete from this timestamp (ms) on (set upon subscription)
+        self.complete_from = np.inf
+        # ... and up to this time (unix ms, machine time): the time of the last refresh from the database
+        self.fresh_until = -np.inf
+
+    @property
+    def last(self):
+        if self.count == 0:
+            return None
+        return self.stamps[(self.count-1) % len(self.stamps)]
+
+    def extend(self, points):
+        # Append (N,2) datapoints, skipping those not newer than the last one
+        last = self.last
+        if last is not None:
+            points = points[points[:,0] > last]
+        n, capacity = len(points), len(self.stamps)
+        if n == 0:
+            return
+        if n > capacity:
+            points = points[-capacity:]
+            n = capacity
+        pos = (self.count + np.arange(n)) % capacity
+        self.stamps[pos] = points[:,0]
+        self.values[pos] = points[:,1]
+        self.count += n
+        if self.count > capacity:
+            # Overwritten datapoints: complete from the oldest retained one
+            self.complete_from = max(self.complete_from, self.stamps[self.count % capacity])
+
+    def range(self, start, end):
+        # (N,2) datapoints within [start,end]
+        capacity = len(self.stamps)
+        n = min(self.count, capacity)
+        first = self.count - n
+        order = (first + np.arange(n)) % capacity
+        stamps = self.stamps[order]
+        i1 = np.searchsorted(stamps, start, side="left")
+        i2 = np.searchsorted(stamps, end, side="right")
+        return np.column_stack((stamps[i1:i2].astype(np.float64), self.values[order[i1:i2]]))
+
+
+class TimeSeriesCache(object):
+
+    def __init__(self, keys, window=300., capacity=65536, poll=0.05, db_address=None):
+        """
+        Parameters
+        ----------
+        keys : list of str
+            Keys to subscribe to.
+        window : float
+            Time (s) of recent data that is loaded upon subscription and answered from the cache.
+        capacity : int
+            Amount of datapoints kept per key (should cover "window" at the write rate of the key).
+        poll : float
+            Interval (s) at which keys are refreshed when no keyspace notifications arrive.
+        db_address : str, optional
+            Address of the database. The default is the configured one.
+        """
+        self.window = window
+        self.capacity = capacity
+        self.poll = poll
+        self.db_address = db_address
+        self.rings = {}
+        self._lock = threading.Lock()
+        self._stop = threading.Event()
+        self._thread = None
+        self.hits = 0
+        self.misses = 0
+        for key in keys:
+            self.subscribe(key)
+
+    def subscribe(self, key):
+        # Start caching a key, loading its last "window" seconds from the database. A key missing in the database is
+        # not cached (queries on it go to the database).
+        ring = _Ring(self.capacity)
+        now = int(time.time()*1000)
+        start = now - int(self.window*1000)
+        ring.complete_from = start
+        try:
+            # Up to an hour ahead, for clocks running ahead of this machine
+            ring.extend(ts_range(key, start, now + 3600000, r=connection(self.db_address)))
+        except redis.ResponseError as e:
+            print(f"Not caching {key}: {e}")
+            return
+        ring.fresh_until = now
+        with self._lock:
+            self.rings[key] = ring
+
+    def covers(self, key, start):
+        ring = self.rings.get(key)
+        return ring is not None and start >= ring.complete_from
+
+    def range(self, key, start, end, lag=0):
+        """
+        (N,2) datapoints of key within [start,end] (ms), timestamps plus lag, as nott_database.ts_range.
+        None if the cache does not cover the range. If end is past the last refresh of the key, the key is refreshed first.
+        """
+        with self._lock:
+            covered = self.covers(key, start)
+            stale = covered and end > self.rings[key].fresh_until
+        if not covered:
+            self.misses += 1
+            return None
+        if stale:
+            try:
+                self.refresh([key])
+            except redis.RedisError:
+                self.misses += 1
+                return None
+        with self._lock:
+            self.hits += 1
+            output = self.rings[key].range(start, end)
+        if lag != 0:
+            output[:,0] += lag
+        return output
+
+    def add(self, key, points, fresh_until=None):
+        # Add (N,2) datapoints of a subscribed key, complete up to fresh_until (unix ms) if given
+        ring = self.rings.get(key)
+        if ring is None:
+            return
+        with self._lock:
+            ring.extend(points)
+            if fresh_until is not None:
+                ring.fresh_until = max(ring.fresh_until, fresh_until)
+
+    def on_flush(self, samples, flushed_at=None):
+        # Flush listener of RedisBatchWriter: (key, timestamp, value) samples just written to the database.
+        # The writer of this process being the only writer of its keys, they are complete up to the flush.
+        fresh_until = time.time()*1000 if flushed_at is None else unix_time_ms(flushed_at)
+        by_key = {}
+        for key, stamp, value in samples:
+            if key in self.rings:
+                by_key.setdefault(key, []).append((stamp, value))
+        for key, points in by_key.items():
+            self.add(key, np.array(points, dtype=np.float64), fresh_until)
+
+    def attach(self, writer):
+        # Keep the cache fresh from a RedisBatchWriter in this process
+        writer.flush_listeners.append(self.on_flush)
+
+    def refresh(self, keys=None):
+        # Fetch the datapoints newer than the cached ones, for all keys in one round trip
+        keys = list(self.rings) if keys is None else keys
+        r = connection(self.db_address)
+        pipe = r.pipeline(transaction=False)
+        for key in keys:
+            ring = self.rings[key]
+            pipe.execute_command("TS.RANGE", key, int(ring.complete_from) if ring.last is None else int(ring.last)+1, "+")
+        # Datapoints written before the request are in the reply
+        requested = time.time()*1000
+        for key, reply in zip(keys, pipe.execute(raise_on_error=False)):
+            if isinstance(reply, Exception):
+                continue
+            self.add(key, _parse_points(reply), requested)
+
+    def start(self):
+        # Start the background thread following keyspace notifications (or polling)
+        if self._thread is not None:
+            return
+        self._stop.clear()
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def stop(self):
+        self._stop.set()
+        if self._thread is not None:
+            self._thread.join()
+            self._thread = None
+
+    def _run(self):
+        r = connection(self.db_address)
+        pubsub = r.pubsub(ignore_subscribe_messages=True)
+        pubsub.psubscribe(*[f"__keyspace@*__:{key}" for key in self.rings])
+        notified = False
+        last_poll = 0.
+        try:
+            while not self._stop.is_set():
+                dirty = set()
+                message = pubsub.get_message(timeout=self.poll)
+                while message is not None:
+                    key = message["channel"]
+                    key = key.decode() if isinstance(key, bytes) else key
+                    dirty.add(key.split(":", 1)[1])
+                    notified = True
+                    message = pubsub.get_message(timeout=0)
+                if not notified and time.time() - last_poll >= self.poll:
+                    # No notifications (not enabled on the server): poll all keys
+                    dirty = set(self.rings)
+                    last_poll = time.time()
+                if dirty:
+                    try:
+                        self.refresh([key for key in dirty if key in self.rings])
+                    except redis.RedisError as e:
+                        print(f"Cache refresh failed: {e}")
+        finally:
+            pubsub.close()
@@ -127,6 +127,25 @@ def read_current_pos(opcua_motor):
     return target_pos
 
 
+# Read cryostat temperature
+def read_cryo_temperature():
+    """ Read the cryostat temperature (PLC node dark_temperature_node), None if it cannot be read """
+
+    # Initialize the OPC UA connection
+    url =  config['DEFAULT']['opcuaaddress']
+
+    try:
+        opcua_conn = OPCUAConnection(url)
+        opcua_conn.connect()
+        temperature = float(opcua_conn.read_node(config['CAMERA']['dark_temperature_node']))
+        opcua_conn.disconnect()
+    except Exception as e:
+        print(f"Failed to read the cryostat temperature: {e}")
+        return None
+
+    return temperature
+
+
 #### SHUTTERS FUNCTIONS ####
 ############################
 
@@ -30,7 +30,88 @@ from nottcontrol.script.lib.nott_time import unix_time_ms
 from datetime import datetime, timedelta
 from scipy.interpolate import interp1d
 import time
+import itertools
 from nottcontrol import config
+from nottcontrol.camera.roi_bus import RoiBusReader
+
+# Per-frame ROI values published in shared memory by a camera process on the same machine
+roi_bus = RoiBusReader()
+
+# Process-wide connection pools, per database address
+_pools = {}
+
+# In-process cache of recent datapoints (see nott_cache.py), None if not enabled
+cache = None
+
+def connection(db_address=None):
+    """
+    Client on the process-wide connection pool of the database at `db_address` (default: the configured database).
+    Connections are opened once and reused by all calls, from all threads. They speak RESP2, whose replies the
+    parsers below expect (recent redis-py versions default to RESP3).
+    """
+    if db_address is None:
+        db_address = config['DEFAULT']['databaseurl']
+    pool = _pools.get(db_address)
+    if pool is None:
+        pool = _pools.setdefault(db_address, redis.ConnectionPool.from_url(db_address, protocol=2))
+    return redis.Redis(connection_pool=pool)
+
+def enable_cache(keys=None, window=None, db_address=None):
+    """
+    Start the in-process cache of recent datapoints of `keys` over the last `window` seconds (defaults: `cache_keys`
+    and `cache_window` in the config file). get_field, get_fields and get_reduced then answer recent time ranges of
+    these keys locally. Returns the cache.
+    """
+    global cache
+    from nottcontrol.script.lib.nott_cache import TimeSeriesCache
+    if keys is None:
+        keys = [key.strip() for key in config['redis']['cache_keys'].split(",")]
+    if window is None:
+        window = config['redis'].getfloat('cache_window')
+    if cache is not None:
+        cache.stop()
+    cache = TimeSeriesCache(keys, window, db_address=db_address)
+    cache.start()
+    return cache
+
+def _cached(field, start):
+    return cache is not None and cache.covers(field, start)
+
+def ts_range(field, start, end, lag=0, out=None, r=None):
+    """
+    Datapoints of `field` within [start,end] (ms), by one TS.RANGE round trip. The raw reply is parsed directly
+    into a float64 array, without intermediate tuples.
+
+    Parameters
+    ----------
+    field : str
+        Field of the database to collect.
+    start, end : int
+        Timestamps in milliseconds.
+    lag : float
+        Lag added to the timestamps, in milliseconds. The default is 0.
+    out : (M,2) float64 array, optional
+        Preallocated buffer. If it holds enough rows, the datapoints are written into its first rows.
+    r : redis client, optional
+        The default is the pooled connection to the configured database.
+
+    Returns
+    -------
+    output : (N,2) float64 array
+        Timestamps (ms, plus lag) and values.
+    """
+    if r is None:
+        r = connection()
+    reply = r.execute_command("TS.RANGE", field, int(start), int(end))
+    n = len(reply)
+    if out is None or len(out) < n:
+        out = np.empty((n, 2))
+    else:
+        out = out[:n]
+    out.reshape(-1)[:] = np.fromiter(itertools.chain.from_iterable(reply), np.float64, 2*n)
+    if lag != 0:
+        out[:,0] += lag
+    return out
 
 # #  Function to read field values from the REDIS database and corresponding delay line position for the last 'delay' ms
 # def get_field(field1, field2, field3, field4, delay, dl_name):
@@ -139,6 +220,26 @@ def get_data(field1, field2, field3, field4, delay):
 
 #     return dl_pos, flx_coh, data_at_null[2], bck
 
+def _on_roi_bus(fields, start):
+    # True if a running camera process on this machine publishes all fields on the ROI bus, from start on
+    return (all(roi_bus.available(field) for field in fields) and roi_bus.covers(start)
+            and roi_bus.live(config['redis'].getfloat('roi_bus_max_age')))
+
+def _read_roi_bus(fields, start, end):
+    """
+    (stamps, values) of fields within [start,end] from the ROI bus, None if they must be read from the database:
+    bus not available or stale, no frames, or the camera not having published the end of the range within roi_bus_wait.
+    """
+    if not _on_roi_bus(fields, start):
+        return None
+    if not roi_bus.wait_until(end, config['redis'].getfloat('roi_bus_wait')):
+        # Bus running behind: the window would be truncated
+        return None
+    stamps, values = roi_bus.read_range(start, end, fields)
+    if stamps is None or len(stamps) == 0:
+        return None
+    return stamps, values
+
 def get_field(field, start, end, return_avg, lag=0, db_address='redis://nott-server.ster.kuleuven.be:6379'):
     """
     Get the data in the database of the required `field` in a time range limited by `start` and `end`.
@@ -154,7 +255,7 @@ def get_field(field, start, end, return_avg, lag=0, db_address='redis://nott-ser
     end : int
         end timestamp in milliseconds. The timezone must be the one of the server.
     return_avg: bool
-        Return the average value on the number of points.
+        Return the average value on the number of points (computed by the database, see get_reduced).
     lag: float
         Lag to add to the timeline, in millisecond. The default is 0.
     db_address : str, optional
@@ -167,24 +268,267 @@ def get_field(field, start, end, return_avg, lag=0, db_address='redis://nott-ser
 
     """
     
-    db_address =  config['DEFAULT']['databaseurl']  
-    
-    # Read data
-    r = redis.from_url(db_address)
+    # Local camera process: read from the shared-memory ROI bus, if it still holds the whole timeframe
+    bus = _read_roi_bus([field], start, end)
+    if bus is not None:
+        stamps, values = bus
+        if return_avg:
+            # As for the database average, the timestamp is the centre of the time range
+            return np.array([(start + end) / 2 + lag, values[:,0].mean()])
+        return np.column_stack((stamps.astype(np.float64) + lag, values[:,0]))
 
-    # Extract data
-    ts = r.ts()
+    db_address =  config['DEFAULT']['databaseurl']  
 
-     # Get ROI values
-    output = ts.range(field, start, end) # This function returns a list of tuples
-    output = np.array(output) # Array
-    output[:,0] = output[:,0] + lag
+    # Recent data, from the in-process cache (None if it cannot answer, e.g. if refreshing the key failed)
+    output = cache.range(field, start, end, lag) if _cached(field, start) else None
+    if output is None:
+        if return_avg:
+            # Average computed by the database; the timestamp is the centre of the time range
+            return np.array([(start + end) / 2 + lag, get_reduced([field], start, end, ("mean",), db_address=db_address)[0,0]])
+        # Get ROI values, over the pooled connection
+        output = ts_range(field, start, end, lag, r=connection(db_address))
 
     if return_avg:
-        output = output.mean(0) # Average along the number of points axis
+        output = np.array([(start + end) / 2 + lag, output[:,1].mean()]) # Average along the number of points axis, centre timestamp
 
     return  output
 
+def _parse_points(points):
+    # Raw [[timestamp, value], ...] reply to a (N,2) float64 array
+    return np.fromiter(itertools.chain.from_iterable(points), np.float64, 2*len(points)).reshape((-1, 2))
+
+def _key(key):
+    return key.decode() if isinstance(key, bytes) else key
+
+def _fetch_series(r, fields, start, end, *options):
+    """
+    Datapoints of each field within [start,end], as a dict of (N,2) arrays: one TS.MRANGE for the series labelled by name,
+    one pipelined round trip of TS.RANGE commands for the others. "options" (e.g. an AGGREGATION) are passed to both.
+    Fields for which the database returns an error map to that exception.
+    """
+    series = {}
+    try:
+        reply = r.execute_command("TS.MRANGE", int(start), int(end), *options, "FILTER", "name=(" + ",".join(fields) + ")")
+        # RESP2: [[key, labels, samples], ...], RESP3 (client not from connection()): {key: [labels, meta, samples]}
+        entries = reply.items() if isinstance(reply, dict) else ((entry[0], entry) for entry in reply)
+        for key, entry in entries:
+            series[_key(key)] = _parse_points(entry[-1])
+    except redis.ResponseError:
+        pass
+    missing = [field for field in fields if field not in series]
+    if len(missing) > 0:
+        pipe = r.pipeline(transaction=False)
+        for field in missing:
+            pipe.execute_command("TS.RANGE", field, int(start), int(end), *options)
+        for field, points in zip(missing, pipe.execute(raise_on_error=False)):
+            series[field] = points if isinstance(points, Exception) else _parse_points(points)
+    return series
+
+def get_fields(fields, start, end, lag=0, fill=None, db_address=None):
+    """
+    Get the data in the database of several `fields` in the time range [`start`,`end`], in one query, aligned on a
+    common timestamp grid (the union of the timestamps of all fields, e.g. the camera frame timestamps for ROI fields).
+
+    Series labelled by name (see RedisClient.label_series) are fetched by a single TS.MRANGE with a label filter,
+    the others by TS.RANGE commands pipelined in one round trip. If the camera process runs on this machine,
+    the ROI fields are read from the shared-memory ROI bus instead.
+
+    Parameters
+    ----------
+    fields : list of str
+        Fields of the database to collect.
+    start, end : int
+        Timestamps in milliseconds.
+    lag : float
+        Lag to add to the timeline, in millisecond. The default is 0.
+    fill : str, optional
+        Handling of missing samples (a field without datapoint at a timestamp of the grid):
+        None (default) : NaN
+        "previous"     : the previous datapoint of that field (NaN before its first datapoint)
+    db_address : str, optional
+        Address of the database. The default is the configured one.
+
+    Returns
+    -------
+    stamps : (samples,) float64 array
+        Timestamps of the grid, in milliseconds (plus lag).
+    values : (keys,samples) float64 array
+        Values of each field on the grid.
+    """
+    fields = list(fields)
+    bus = _read_roi_bus(fields, start, end)
+    if bus is not None:
+        stamps, values = bus
+        return stamps.astype(np.float64) + lag, values.T.copy()
+
+    # Recent data of cached fields from the in-process cache, the others (and those the cache cannot answer) from the database
+    series = {}
+    for field in fields:
+        points = cache.range(field, start, end) if _cached(field, start) else None
+        if points is not None:
+            series[field] = points
+    remote = [field for field in fields if field not in series]
+    if len(remote) > 0:
+        series.update(_fetch_series(connection(db_address), remote, start, end))
+    # A missing key only yields missing samples
+    series = {field: np.zeros((0, 2)) if isinstance(points, Exception) else points for field, points in series.items()}
+
+    # Common grid and (keys,samples) matrix
+    stamps = np.unique(np.concatenate([series[field][:,0] for field in fields]))
+    values = np.full((len(fields), len(stamps)), np.nan)
+    for i, field in enumerate(fields):
+        points = series[field]
+        values[i, np.searchsorted(stamps, points[:,0])] = points[:,1]
+    if fill == "previous":
+        # Index of the last valid sample, carried forward
+        valid = ~np.isnan(values)
+        last = np.maximum.accumulate(np.where(valid, np.arange(len(stamps))[np.newaxis], 0), axis=1)
+        started = np.maximum.accumulate(valid, axis=1)
+        values = np.where(started, np.take_along_axis(values, last, axis=1), np.nan)
+    elif fill is not None:
+        raise ValueError(f"Unknown fill {fill}, expected None or previous")
+    return stamps + lag, values
+
+# Reductions: RedisTimeSeries aggregator, and the equivalent local reduction
+reductions = {"mean": ("avg", np.nanmean),
+              "std": ("std.p", np.nanstd),
+              "var": ("var.p", np.nanvar),
+              "min": ("min", np.nanmin),
+              "max": ("max", np.nanmax),
+              "sum": ("sum", np.nansum),
+              "count": ("count", lambda values, axis: np.count_nonzero(~np.isnan(values), axis=axis).astype(np.float64)),
+              "first": ("first", None),
+              "last": ("last", None)}
+
+def _reduce_local(stamps, values, start, end, names, bucket):
+    # Local reduction of a (keys,samples) matrix into (reductions,keys,buckets)
+    nbuckets = int(np.ceil((end - start + 1) / bucket))
+    edges = np.searchsorted(stamps, start + bucket*np.arange(nbuckets+1))
+    out = np.full((len(names), values.shape[0], nbuckets), np.nan)
+    for k in range(nbuckets):
+        block = values[:, edges[k]:edges[k+1]]
+        valid = ~np.isnan(block)
+        for i, name in enumerate(names):
+            if name == "count":
+                out[i, :, k] = valid.sum(axis=1)
+                continue
+            for j in np.flatnonzero(valid.any(axis=1)):
+                row = block[j][valid[j]]
+                if name == "first":
+                    out[i, j, k] = row[0]
+                elif name == "last":
+                    out[i, j, k] = row[-1]
+                else:
+                    out[i, j, k] = reductions[name][1](row, axis=0)
+    return out
+
+def get_reduced(fields, start, end, names=("mean",), bucket=None, lag=0, db_address=None):
+    """
+    Reductions of `fields` over the time range [`start`,`end`], or over buckets of `bucket` ms aligned on `start`.
+    The reductions are computed by the database (TS.RANGE/TS.MRANGE ... AGGREGATION), all fields and reductions in one
+    round trip, so that only the reduced values are transferred. Fields the database cannot reduce (e.g. an aggregator
+    unknown to an older RedisTimeSeries) are fetched and reduced locally, as are fields read from the ROI bus.
+
+    Parameters
+    ----------
+    fields : list of str
+        Fields of the database.
+    start, end : int
+        Timestamps in milliseconds.
+    names : tuple of str
+        Reductions, among "mean", "std" (population), "var", "min", "max", "sum", "count", "first", "last".
+    bucket : int, optional
+        Bucket duration in milliseconds. The default is the whole range.
+    lag : float
+        Lag to add to the bucket timestamps, in millisecond. The default is 0.
+
+    Returns
+    -------
+    If bucket is None : values, (reductions,keys) float64 array
+    Else : (stamps, values), the (buckets,) start timestamps of the buckets (plus lag) and the (reductions,keys,buckets) values.
+        Empty buckets are NaN (count: 0).
+    """
+    fields = list(fields)
+    for name in names:
+        if name not in reductions:
+            raise ValueError(f"Unknown reduction {name}, expected one of {list(reductions)}")
+    whole = bucket is None
+    bucket = int(end - start + 1) if whole else int(bucket)
+    nbuckets = int(np.ceil((end - start + 1) / bucket))
+    out = np.full((len(names), len(fields), nbuckets), np.nan)
+
+    # Fields on the ROI bus or in the in-process cache are reduced locally
+    if _on_roi_bus(fields, start):
+        local = list(fields)
+    else:
+        local = [field for field in fields if _cached(field, start)]
+    remote = [field for field in fields if field not in local]
+    if len(remote) > 0:
+        r = connection(db_address)
+        pipe = r.pipeline(transaction=False)
+        for name in names:
+            for field in remote:
+                pipe.execute_command("TS.RANGE", field, int(start), int(end), "ALIGN", int(start), "AGGREGATION", reductions[name][0], bucket)
+        replies = pipe.execute(raise_on_error=False)
+        for i, name in enumerate(names):
+            for j, field in enumerate(remote):
+                reply = replies[i*len(remote) + j]
+                if isinstance(reply, redis.ResponseError):
+                    if field not in local:
+                        local.append(field)
+                    continue
+                points = _parse_points(reply)
+                k = ((points[:,0] - start) // bucket).astype(int)
+                keep = (k >= 0) & (k < nbuckets)
+                out[i, fields.index(field), k[keep]] = points[keep, 1]
+        if "count" in names:
+            count = out[names.index("count")]
+            count[np.isnan(count)] = 0.
+    if len(local) > 0:
+        stamps, values = get_fields(local, start, end, db_address=db_address)
+        local_out = _reduce_local(stamps, values, start, end, names, bucket)
+        for j, field in enumerate(local):
+            out[:, fields.index(field)] = local_out[:, j]
+
+    if whole:
+        return out[..., 0]
+    return start + bucket*np.arange(nbuckets) + lag, out
+
+def get_cam_delay(average, max_age=30000, db_address='redis://nott-server.ster.kuleuven.be:6379'):
+    """
+    Get the delay between the camera timestamps and their registration in the database, as continuously
+    estimated by the camera clock model (see camera/clock_model.py) and published under the "cam_clock" key.
+
+    Parameters
+    ----------
+    average : bool
+        If True, return the average delay. If False, return the (slowly decaying) maximum delay.
+    max_age : int
+        Maximal age of the published model, in milliseconds. Older models are ignored.
+    db_address : str, optional
+        Address of the database. The default is 'redis://nott-server.ster.kuleuven.be:6379'.
+
+    Returns
+    -------
+    t_delay : float or None
+        Delay in milliseconds. None if no recent estimate is available.
+    """
+
+    db_address =  config['DEFAULT']['databaseurl']
+
+    r = connection(db_address)
+    cam_clock = r.json().get("cam_clock", "$")
+    if cam_clock is None:
+        return None
+    cam_clock = cam_clock[0]
+    if time.time()*1000 - cam_clock["updated"] > max_age:
+        return None
+
+    if average:
+        return cam_clock["write_delay_ms"]
+    else:
+        return cam_clock["write_delay_max_ms"]
+
 def define_time(delay):
     """
     Return the rounded timestamps of the start and end of period to grab from the database, in milliseconds.
@@ -0,0 +1,227 @@
+# -*- coding: utf-8 -*-
+"""
+Created on Sat Oct 17 13:40:52 2026
+
+Merge-join of two timestamped series: values of a "source" series (e.g. delay line positions) at the timestamps of a
+"target" series (e.g. ROI values), in O(n) without spline construction.
+
+Three modes are available:
+    "linear"   : linear interpolation between the two source datapoints around each target timestamp
+    "pchip"    : monotone piecewise cubic (Fritsch-Carlson slopes, as scipy's PchipInterpolator), which does not
+                 overshoot between datapoints, so that a monotonic scan stays monotonic
+    "previous" : last source datapoint at or before each target timestamp (sample and hold)
+Target timestamps outside the source range get "fill" (for "previous", only those before the first datapoint).
+
+The join is available in batch (interpolate, join) and incrementally (StreamJoin), for datapoints arriving while
+scanning. Both give the same values.
+
+"""
+
+import numpy as np
+
+modes = ("linear", "pchip", "previous")
+
+
+def _sorted(t, v):
+    # Source datapoints in increasing time order, without repeated timestamps (the last datapoint is kept)
+    t = np.asarray(t, dtype=np.float64)
+    v = np.asarray(v, dtype=np.float64)
+    if len(t) > 1 and not np.all(t[1:] >= t[:-1]):
+        order = np.argsort(t, kind="stable")
+        t, v = t[order], v[order]
+    if len(t) > 1:
+        keep = np.append(t[1:] != t[:-1], True)
+        if not keep.all():
+            t, v = t[keep], v[keep]
+    return t, v
+
+
+def pchip_slopes(t, v):
+    """
+    Slopes of the monotone cubic at the datapoints (t increasing): weighted harmonic mean of the neighbouring secants,
+    zero at local extrema, and the shape-preserving three-point formula at both ends.
+    """
+    n = len(t)
+    h = np.diff(t)
+    delta = np.diff(v) / h
+    d = np.zeros(n)
+    if n == 2:
+        d[:] = delta[0]
+    if n <= 2:
+        return d
+    # Interior datapoints
+    w1 = 2*h[1:] + h[:-1]
+    w2 = h[1:] + 2*h[:-1]
+    same = (np.sign(delta[1:]) * np.sign(delta[:-1])) > 0
+    with np.errstate(divide="ignore", invalid="ignore"):
+        d[1:-1] = np.where(same, (w1 + w2) / (w1/delta[:-1] + w2/delta[1:]), 0.)
+    d[0] = _edge_slope(h[0], h[1], delta[0], delta[1])
+    d[-1] = _edge_slope(h[-1], h[-2], delta[-1], delta[-2])
+    return d
+
+
+def _edge_slope(h0, h1, m0, m1):
+    # Non-centred three-point slope at an end, limited to keep the shape
+    d = ((2*h0 + h1)*m0 - h0*m1) / (h0 + h1)
+    if np.sign(d) != np.sign(m0):
+        return 0.
+    if np.sign(m0) != np.sign(m1) and abs(d) > abs(3*m0):
+        return 3*m0
+    return d
+
+
+def interpolate(t_src, v_src, t_dst, mode="linear", fill=np.nan):
+    """
+    Values of a source series at target timestamps.
+
+    Parameters
+    ----------
+    t_src, v_src : (N,) numpy arrays
+        Source timestamps and values. Sorted once if not in increasing order (e.g. reverted scans).
+    t_dst : (M,) numpy array
+        Target timestamps, in any order.
+    mode : str
+        "linear", "pchip" or "previous" (see above).
+    fill : float
+        Value at target timestamps outside the source range. The default is NaN.
+
+    Returns
+    -------
+    values : (M,) numpy array
+    """
+    if mode not in modes:
+        raise ValueError(f"Unknown join mode {mode}, expected one of {modes}")
+    t, v = _sorted(t_src, v_src)
+    t_dst = np.asarray(t_dst, dtype=np.float64)
+    out = np.full(t_dst.shape, fill, dtype=np.float64)
+    if len(t) == 0:
+        return out
+    # Index of the last source datapoint at or before each target
+    j = np.searchsorted(t, t_dst, side="right") - 1
+    if mode == "previous":
+        inside = j >= 0
+        out[inside] = v[j[inside]]
+        return out
+    inside = (t_dst >= t[0]) & (t_dst <= t[-1])
+    if len(t) == 1:
+        out[inside] = v[0]
+        return out
+    j = np.clip(j[inside], 0, len(t)-2)
+    h = t[j+1] - t[j]
+    s = (t_dst[inside] - t[j]) / h
+    if mode == "linear":
+        out[inside] = v[j] + s*(v[j+1] - v[j])
+        return out
+    # Cubic Hermite between datapoints j and j+1
+    d = pchip_slopes(t, v)
+    s2, s3 = s*s, s*s*s
+    out[inside] = (2*s3 - 3*s2 + 1)*v[j] + (s3 - 2*s2 + s)*h*d[j] + (-2*s3 + 3*s2)*v[j+1] + (s3 - s2)*h*d[j+1]
+    return out
+
+
+def join(source, target, mode="linear", fill=np.nan):
+    """
+    Source values at the datapoints of a target series, as returned by nott_database.get_field.
+
+    Parameters
+    ----------
+    source, target : (N,2) and (M,2) numpy arrays
+        Datapoints (timestamp, value).
+
+    Returns
+    -------
+    (M,3) numpy array : timestamp, source value and target value of each target datapoint.
+    """
+    source = np.asarray(source, dtype=np.float64).reshape((-1, 2))
+    target = np.asarray(target, dtype=np.float64).reshape((-1, 2))
+    values = interpolate(source[:,0], source[:,1], target[:,0], mode, fill)
+    return np.column_stack((target[:,0], values, target[:,1]))
+
+
+def monotone_order(x):
+    """
+    Indices that sort x: a plain slice if x is already monotonic (e.g. positions of a scan), else an argsort.
+    """
+    if len(x) < 2 or np.all(x[1:] >= x[:-1]):
+        return slice(None)
+    if np.all(x[1:] <= x[:-1]):
+        return slice(None, None, -1)
+    return np.argsort(x, kind="stable")
+
+
+class StreamJoin(object):
+    # Incremental join: source and target datapoints are added as they arrive, joined target datapoints are popped
+    # once no later source datapoint can change them.
+
+    def __init__(self, mode="linear", fill=np.nan):
+        """
+        Parameters
+        ----------
+        mode : str
+            "linear", "pchip" or "previous" (see above).
+        fill : float
+            Value of target datapoints before the first source datapoint (and, upon flush, after the last one).
+        """
+        if mode not in modes:
+            raise ValueError(f"Unknown join mode {mode}, expected one of {modes}")
+        self.mode = mode
+        self.fill = fill
+        self.source = np.zeros((0, 2))
+        self.target = np.zeros((0, 2))
+        # Timestamp of the last popped target datapoint
+        self._popped = -np.inf
+
+    def add_source(self, points):
+        # Append (N,2) source datapoints, in increasing time order and later than the previous ones
+        points = np.asarray(points, dtype=np.float64).reshape((-1, 2))
+        if len(self.source):
+            points = points[points[:,0] > self.source[-1,0]]
+        self.source = np.concatenate((self.source, points))
+
+    def add_target(self, points):
+        # Append (N,2) target datapoints, in increasing time order
+        points = np.asarray(points, dtype=np.float64).reshape((-1, 2))
+        self.target = np.concatenate((self.target, points))
+
+    def _ready(self):
+        # Amount of pending target datapoints that are final: a source datapoint at or after them is known
+        # (for pchip, one more, as the slope at a datapoint depends on the next one)
+        lookahead = 2 if self.mode == "pchip" else 1
+        if len(self.source) < lookahead:
+            return 0
+        return np.searchsorted(self.target[:,0], self.source[-lookahead,0], side="right")
+
+    def _join(self, target):
+        values = interpolate(self.source[:,0], self.source[:,1], target[:,0], self.mode, self.fill)
+        return np.column_stack((target[:,0], values, target[:,1]))
+
+    def pop(self):
+        """
+        Joined target datapoints that are final, in order.
+
+        Returns
+        -------
+        (M,3) numpy array : timestamp, source value and target value.
+        """
+        n = self._ready()
+        out = self._join(self.target[:n])
+        if n > 0:
+            self._popped = self.target[n-1,0]
+        self.target = self.target[n:]
+        self._trim()
+        return out
+
+    def flush(self):
+        # Join all pending target datapoints with the source datapoints known so far, as the batch join would
+        out = self._join(self.target)
+        self.target = self.target[:0]
+        return out
+
+    def _trim(self):
+        # Drop the source datapoints no pending or later target can use: keep the last one at or before the earliest
+        # such target, plus one before it for the pchip slope (interior slopes then match the batch join)
+        t_next = self.target[0,0] if len(self.target) else self._popped
+        j = np.searchsorted(self.source[:,0], t_next, side="right") - 1
+        first = j - 1 if self.mode == "pchip" else j
+        if first > 0:
+            self.source = self.source[first:]